@@ -0,0 +1,68 @@
+/*
+ * Helpers shared by the libcoro benchmarks.
+ *
+ * Every benchmark prints one JSON object per measurement on stdout, so
+ * results of different builds (backends, releases) can be collected and
+ * compared by a script.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "coro.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline const char *
+bench_backend (void)
+{
+#if CORO_UCONTEXT
+  return "ucontext";
+#elif CORO_SJLJ
+  return "setjmp";
+#elif CORO_LINUX
+  return "linux";
+#elif CORO_LOSER
+  return "loser";
+#elif CORO_IRIX
+  return "irix";
+#elif CORO_ASM
+  return "asm";
+#elif CORO_PTHREAD
+  return "pthread";
+#elif CORO_FIBER
+  return "fiber";
+#else
+  return "unknown";
+#endif
+}
+
+/* monotonic time in nanoseconds */
+static inline double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the iteration count given on the command line, or dflt */
+static inline unsigned long
+bench_count (int argc, char *argv[], unsigned long dflt)
+{
+  return argc > 1 ? strtoul (argv[1], 0, 0) : dflt;
+}
+
+static inline void
+bench_report (const char *name, unsigned long count, const char *unit, double value)
+{
+  printf ("{\"backend\":\"%s\",\"benchmark\":\"%s\",\"count\":%lu,\"unit\":\"%s\",\"value\":%.2f}\n",
+          bench_backend (), name, count, unit, value);
+  fflush (stdout);
+}
+
+#endif
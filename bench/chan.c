@@ -0,0 +1,247 @@
+/*
+ * Channel throughput on the scheduler: two tasks ping-pong a counter
+ * over a pair of SPSC channels (every message is a direct handoff),
+ * four producers and four consumers share an MPMC channel, and one
+ * producer streams to one consumer in batches with coro_chan_send_n and
+ * coro_chan_recv_n. Reports nanoseconds per message for the number of
+ * workers given as the second argument (0: one per cpu), and fails if a
+ * message goes missing. Finally one producer streams to one consumer on
+ * two workers, through a small SPSC channel, and it fails if a message
+ * arrives out of order.
+ */
+
+#include "bench.h"
+#include "corochan.h"
+
+#include <stdint.h>
+
+#define PRODUCERS 4
+#define BATCH     64
+
+static unsigned long count;
+static struct coro_chan *ping_chan, *pong_chan, *chan;
+static unsigned long received; /* sum of what the consumers got */
+static unsigned int producers_left;
+static int out_of_order;
+
+static void
+ping (void *arg)
+{
+  unsigned long i;
+  void *msg;
+
+  (void)arg;
+
+  for (i = 1; i <= count; ++i)
+    if (!coro_chan_send (ping_chan, (void *)(uintptr_t)i)
+        || !coro_chan_recv (pong_chan, &msg))
+      break;
+    else
+      __atomic_add_fetch (&received, (uintptr_t)msg, __ATOMIC_RELAXED);
+
+  coro_chan_close (ping_chan);
+}
+
+static void
+pong (void *arg)
+{
+  void *msg;
+
+  (void)arg;
+
+  while (coro_chan_recv (ping_chan, &msg))
+    coro_chan_send (pong_chan, msg);
+}
+
+static void
+produce (void *arg)
+{
+  unsigned long i;
+
+  for (i = (uintptr_t)arg; i <= count; i += PRODUCERS)
+    coro_chan_send (chan, (void *)(uintptr_t)i);
+
+  /* the others are done sending once the last one gets here */
+  if (!__atomic_sub_fetch (&producers_left, 1, __ATOMIC_ACQ_REL))
+    coro_chan_close (chan);
+}
+
+static void
+consume (void *arg)
+{
+  unsigned long sum = 0;
+  void *msg;
+
+  (void)arg;
+
+  while (coro_chan_recv (chan, &msg))
+    sum += (uintptr_t)msg;
+
+  __atomic_add_fetch (&received, sum, __ATOMIC_RELAXED);
+}
+
+static void
+produce_batch (void *arg)
+{
+  void *msgs [BATCH];
+  unsigned long i = 1;
+
+  (void)arg;
+
+  while (i <= count)
+    {
+      unsigned int n;
+
+      for (n = 0; n < BATCH && i <= count; ++n)
+        msgs [n] = (void *)(uintptr_t)i++;
+
+      coro_chan_send_n (chan, msgs, n);
+    }
+
+  coro_chan_close (chan);
+}
+
+static void
+consume_batch (void *arg)
+{
+  void *msgs [BATCH];
+  unsigned long sum = 0;
+  unsigned int n, i;
+
+  (void)arg;
+
+  while ((n = coro_chan_recv_n (chan, msgs, BATCH)))
+    for (i = 0; i < n; ++i)
+      sum += (uintptr_t)msgs [i];
+
+  __atomic_add_fetch (&received, sum, __ATOMIC_RELAXED);
+}
+
+static void
+produce_order (void *arg)
+{
+  unsigned long i;
+
+  (void)arg;
+
+  for (i = 1; i <= count; ++i)
+    coro_chan_send (chan, (void *)(uintptr_t)i);
+
+  coro_chan_close (chan);
+}
+
+static void
+consume_order (void *arg)
+{
+  unsigned long sum = 0, last = 0;
+  void *msg;
+
+  (void)arg;
+
+  while (coro_chan_recv (chan, &msg))
+    {
+      if ((uintptr_t)msg <= last)
+        out_of_order = 1;
+
+      last = (uintptr_t)msg;
+      sum += last;
+    }
+
+  __atomic_add_fetch (&received, sum, __ATOMIC_RELAXED);
+}
+
+static int
+check (const char *name, unsigned int nworkers, double start)
+{
+  char fullname [64];
+
+  if (received != count * (count + 1) / 2)
+    {
+      fprintf (stderr, "%s: messages went missing\n", name);
+      return 1;
+    }
+
+  snprintf (fullname, sizeof (fullname), "%s-%s", name, nworkers == 1 ? "1" : "n");
+  bench_report (fullname, count, "ns/msg", (bench_now () - start) / count);
+  received = 0;
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned int i, nworkers = argc > 2 ? strtoul (argv[2], 0, 0) : 0;
+  struct coro_sched *sched = coro_sched_new (nworkers);
+  double start;
+
+  count = bench_count (argc, argv, 1000000);
+
+  if (!sched)
+    {
+      perror ("coro_sched_new");
+      return 1;
+    }
+
+  ping_chan = coro_chan_new (1, CORO_CHAN_SPSC);
+  pong_chan = coro_chan_new (1, CORO_CHAN_SPSC);
+  start = bench_now ();
+  coro_sched_spawn (sched, ping, 0, 0);
+  coro_sched_spawn (sched, pong, 0, 0);
+  coro_sched_wait (sched);
+  if (check ("chan-pingpong", nworkers, start))
+    return 1;
+
+  chan = coro_chan_new (256, CORO_CHAN_MPMC);
+  producers_left = PRODUCERS;
+  start = bench_now ();
+  for (i = 0; i < PRODUCERS; ++i)
+    {
+      coro_sched_spawn (sched, produce, (void *)(uintptr_t)(i + 1), 0);
+      coro_sched_spawn (sched, consume, 0, 0);
+    }
+  coro_sched_wait (sched);
+  if (check ("chan-mpmc", nworkers, start))
+    return 1;
+
+  coro_chan_free (chan);
+  chan = coro_chan_new (1024, CORO_CHAN_SPSC);
+  start = bench_now ();
+  coro_sched_spawn (sched, produce_batch, 0, 0);
+  coro_sched_spawn (sched, consume_batch, 0, 0);
+  coro_sched_wait (sched);
+  if (check ("chan-batch", nworkers, start))
+    return 1;
+
+  coro_chan_free (chan);
+  coro_sched_free (sched);
+
+  /* two workers even on one cpu, so sender and receiver race */
+  sched = coro_sched_new (2);
+
+  if (!sched)
+    {
+      perror ("coro_sched_new");
+      return 1;
+    }
+
+  chan = coro_chan_new (64, CORO_CHAN_SPSC);
+  start = bench_now ();
+  coro_sched_spawn (sched, produce_order, 0, 0);
+  coro_sched_spawn (sched, consume_order, 0, 0);
+  coro_sched_wait (sched);
+  if (out_of_order)
+    {
+      fprintf (stderr, "chan-order: messages arrived out of order\n");
+      return 1;
+    }
+  if (check ("chan-order", 2, start))
+    return 1;
+
+  coro_chan_free (chan);
+  coro_chan_free (pong_chan);
+  coro_chan_free (ping_chan);
+  coro_sched_free (sched);
+
+  return 0;
+}
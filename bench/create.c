@@ -0,0 +1,47 @@
+/*
+ * Creation cost: coro_create (and coro_destroy) on an already allocated
+ * stack. The coroutine is never run.
+ */
+
+#include "bench.h"
+
+static void
+idle (void *arg)
+{
+  (void)arg;
+}
+
+int
+main (int argc, char *argv[])
+{
+#if CORO_PTHREAD
+  /* destroyed threads exit asynchronously, so they cannot share a stack */
+  unsigned long i, count = bench_count (argc, argv, 1000), nstacks = count;
+  unsigned int size = 65536;
+#else
+  unsigned long i, count = bench_count (argc, argv, 100000), nstacks = 1;
+  unsigned int size = 16384;
+#endif
+  struct coro_stack *stack = (struct coro_stack *)calloc (nstacks, sizeof (struct coro_stack));
+  coro_context ctx;
+  double start;
+
+  for (i = 0; i < nstacks; ++i)
+    if (!coro_stack_alloc (stack + i, size))
+      {
+        perror ("coro_stack_alloc");
+        return 1;
+      }
+
+  start = bench_now ();
+
+  for (i = 0; i < count; ++i)
+    {
+      coro_create (&ctx, idle, 0, stack [i % nstacks].sptr, stack [i % nstacks].ssze);
+      coro_destroy (&ctx);
+    }
+
+  bench_report ("create", count, "ns/create", (bench_now () - start) / count);
+
+  return 0;
+}
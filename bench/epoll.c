@@ -0,0 +1,269 @@
+/*
+ * epoll reactor latency: two coroutines ping-pong a counter, first
+ * over a pair of pipes, then over a loopback TCP connection, which the
+ * coroutines accept and connect themselves. Reports nanoseconds per
+ * round trip, i.e. per two writes and two reads, and fails if a message
+ * comes back wrong. Finally checks that a coroutine that waited for
+ * input and output on one fd, and was woken for output, is not woken
+ * through that fd again while it waits on another one.
+ */
+
+#define _GNU_SOURCE /* pipe2 */
+
+#include "bench.h"
+#include "coroepoll.h"
+
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static struct coro_epoll *ep;
+static unsigned long count;
+static int failed;
+
+static int ping_fd [2], pong_fd [2]; /* fds the pinger resp. ponger reads from and writes to */
+
+static int
+readn (int fd, unsigned long *msg)
+{
+  unsigned int got = 0;
+
+  while (got < sizeof (*msg))
+    {
+      int res = coro_epoll_read (ep, fd, (char *)msg + got, sizeof (*msg) - got, -1);
+
+      if (res <= 0)
+        return 0;
+
+      got += res;
+    }
+
+  return 1;
+}
+
+static void
+ping (void *arg)
+{
+  unsigned long i, msg;
+
+  (void)arg;
+
+  for (i = 0; i < count; ++i)
+    if (coro_epoll_write (ep, ping_fd [1], &i, sizeof (i), -1) != sizeof (i)
+        || !readn (ping_fd [0], &msg) || msg != i + 1)
+      {
+        failed = 1;
+        break;
+      }
+
+  coro_epoll_close (ep, ping_fd [1]);
+}
+
+static void
+pong (void *arg)
+{
+  unsigned long msg;
+
+  (void)arg;
+
+  while (readn (pong_fd [0], &msg))
+    {
+      ++msg;
+
+      if (coro_epoll_write (ep, pong_fd [1], &msg, sizeof (msg), -1) != sizeof (msg))
+        {
+          failed = 1;
+          break;
+        }
+    }
+
+  coro_epoll_close (ep, pong_fd [1]);
+}
+
+static struct sockaddr_in addr;
+static int listen_fd;
+
+static void
+server (void *arg)
+{
+  int fd = coro_epoll_accept (ep, listen_fd, 0, 0);
+
+  (void)arg;
+
+  if (fd < 0)
+    {
+      fprintf (stderr, "accept: %s\n", strerror (-fd));
+      failed = 1;
+      return;
+    }
+
+  pong_fd [0] = pong_fd [1] = fd;
+  pong (0);
+}
+
+static void
+client (void *arg)
+{
+  int fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int one = 1, res;
+
+  (void)arg;
+
+  res = coro_epoll_connect (ep, fd, (struct sockaddr *)&addr, sizeof (addr));
+
+  if (res < 0)
+    {
+      fprintf (stderr, "connect: %s\n", strerror (-res));
+      failed = 1;
+      return;
+    }
+
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+  ping_fd [0] = ping_fd [1] = fd;
+  ping (0);
+}
+
+static int stale_fd [2], other_fd [2];
+
+static void
+stale_waiter (void *arg)
+{
+  unsigned long msg;
+
+  (void)arg;
+
+  /* writable right away, so this returns for output with input still wanted */
+  if (coro_epoll_wait (ep, stale_fd [1], EPOLLIN | EPOLLOUT) != EPOLLOUT
+      || coro_epoll_read (ep, other_fd [0], &msg, sizeof (msg), -1) != sizeof (msg)
+      || msg != 42)
+    failed = 1;
+
+  coro_epoll_close (ep, stale_fd [1]);
+  coro_epoll_close (ep, other_fd [0]);
+}
+
+static void
+stale_waker (void *arg)
+{
+  unsigned long msg = 42;
+
+  (void)arg;
+
+  /* let the waiter park on other_fd, then make stale_fd report an error */
+  coro_epoll_sleep (ep, 10);
+  close (stale_fd [0]);
+  coro_epoll_sleep (ep, 10);
+
+  if (coro_epoll_write (ep, other_fd [1], &msg, sizeof (msg), -1) != sizeof (msg))
+    failed = 1;
+
+  coro_epoll_close (ep, other_fd [1]);
+}
+
+static int
+run (const char *name, coro_func a, coro_func b)
+{
+  double start = bench_now ();
+
+  if (!coro_epoll_spawn (ep, a, 0, 0) || !coro_epoll_spawn (ep, b, 0, 0))
+    {
+      perror ("coro_epoll_spawn");
+      return 1;
+    }
+
+  if (coro_epoll_run (ep) < 0)
+    {
+      perror ("coro_epoll_run");
+      return 1;
+    }
+
+  if (failed)
+    {
+      fprintf (stderr, "%s: message lost or corrupted\n", name);
+      return 1;
+    }
+
+  bench_report (name, count, "ns/roundtrip", (bench_now () - start) / count);
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  socklen_t len = sizeof (addr);
+  int p1 [2], p2 [2];
+
+  count = bench_count (argc, argv, 100000);
+  ep = coro_epoll_new ();
+
+  if (!ep)
+    {
+      perror ("coro_epoll_new");
+      return 1;
+    }
+
+  if (pipe2 (p1, O_NONBLOCK) || pipe2 (p2, O_NONBLOCK))
+    {
+      perror ("pipe");
+      return 1;
+    }
+
+  ping_fd [0] = p2 [0]; ping_fd [1] = p1 [1];
+  pong_fd [0] = p1 [0]; pong_fd [1] = p2 [1];
+
+  if (run ("epoll-pipe", ping, pong))
+    return 1;
+
+  coro_epoll_close (ep, p1 [0]);
+  coro_epoll_close (ep, p2 [0]);
+
+  listen_fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (listen_fd < 0
+      || bind (listen_fd, (struct sockaddr *)&addr, sizeof (addr))
+      || listen (listen_fd, 1)
+      || getsockname (listen_fd, (struct sockaddr *)&addr, &len))
+    {
+      perror ("listen");
+      return 1;
+    }
+
+  if (run ("epoll-tcp", server, client))
+    return 1;
+
+  coro_epoll_close (ep, listen_fd);
+
+  /* a waiter that gave up early must make the waker fail, not kill us */
+  signal (SIGPIPE, SIG_IGN);
+
+  if (pipe2 (stale_fd, O_NONBLOCK) || pipe2 (other_fd, O_NONBLOCK))
+    {
+      perror ("pipe");
+      return 1;
+    }
+
+  if (!coro_epoll_spawn (ep, stale_waiter, 0, 0) || !coro_epoll_spawn (ep, stale_waker, 0, 0)
+      || coro_epoll_run (ep) < 0)
+    {
+      perror ("epoll-stale");
+      return 1;
+    }
+
+  if (failed)
+    {
+      fprintf (stderr, "epoll-stale: woken through an fd it no longer waits on\n");
+      return 1;
+    }
+
+  coro_epoll_free (ep);
+
+  return 0;
+}
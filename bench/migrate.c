@@ -0,0 +1,221 @@
+/*
+ * Stress test for moving coroutines between threads: a few threads pass
+ * a set of coroutines around in a ring, so that every coroutine is
+ * resumed on a different thread than the one it was suspended on, each
+ * time. The coroutines check that they see the thread-local variables
+ * and errno of the thread they run on (through CORO_TLS_ACCESSOR and
+ * coro_errno), that the threads see the errno they set, and that their
+ * own registers and stack survive. Reports nanoseconds per migration and
+ * fails on the first inconsistency.
+ */
+
+#include "bench.h"
+
+#include <errno.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define COROS   64
+
+struct thread;
+
+struct coro
+{
+  coro_context ctx;
+  struct coro_stack stack;
+  struct thread *thread; /* the one resuming it */
+  struct coro *next;
+  unsigned long runs, check;
+  int done;
+};
+
+struct thread
+{
+  pthread_t id;
+  coro_context ctx;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct coro *head, **tail;
+  struct thread *next; /* where coroutines go after running here */
+  int *errno_location;
+};
+
+static struct thread threads [THREADS];
+static struct coro coros [COROS];
+static unsigned long runs;
+static unsigned int finished;
+static int failed;
+
+static __thread struct thread *self;
+
+CORO_TLS_ACCESSOR (struct thread *, self_location, self)
+
+static void
+fail (const char *what)
+{
+  fprintf (stderr, "migrate: %s\n", what);
+  __atomic_store_n (&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void
+migrant (void *arg)
+{
+  struct coro *co = (struct coro *)arg;
+  /* volatile, as the setjmp backend would otherwise lose them */
+  volatile unsigned long i, sum = 0;
+  volatile double fsum = 0.;
+
+  for (i = 0; i < runs; ++i)
+    {
+      struct thread *thread = co->thread;
+
+      if (*self_location () != thread)
+        fail ("thread-local variable of the wrong thread");
+
+      if (coro_errno_location () != thread->errno_location)
+        fail ("errno of the wrong thread");
+
+      /* checked by the thread once we are back */
+      coro_errno = (int)(i & 0x7fff);
+
+      sum  += i;
+      fsum += i;
+      co->check += i;
+
+      coro_transfer (&co->ctx, &thread->ctx);
+    }
+
+  if (sum != co->check || fsum != (double)co->check)
+    fail ("registers or stack corrupted");
+
+  co->done = 1;
+  coro_transfer (&co->ctx, &co->thread->ctx);
+}
+
+static void
+push (struct thread *thread, struct coro *co)
+{
+  pthread_mutex_lock (&thread->lock);
+  co->next = 0;
+  *thread->tail = co;
+  thread->tail = &co->next;
+  pthread_cond_signal (&thread->wake);
+  pthread_mutex_unlock (&thread->lock);
+}
+
+static void *
+run (void *arg)
+{
+  struct thread *thread = (struct thread *)arg;
+
+  self = thread;
+  thread->errno_location = &errno;
+  coro_create (&thread->ctx, 0, 0, 0, 0);
+
+  for (;;)
+    {
+      struct coro *volatile co;
+      int expect;
+
+      pthread_mutex_lock (&thread->lock);
+
+      while (!thread->head && __atomic_load_n (&finished, __ATOMIC_ACQUIRE) < COROS)
+        pthread_cond_wait (&thread->wake, &thread->lock);
+
+      if (!(co = thread->head))
+        {
+          pthread_mutex_unlock (&thread->lock);
+          break;
+        }
+
+      if (!(thread->head = co->next))
+        thread->tail = &thread->head;
+
+      pthread_mutex_unlock (&thread->lock);
+
+      expect = (int)(co->runs & 0x7fff);
+      errno = -1;
+      co->thread = thread;
+      coro_transfer (&thread->ctx, &co->ctx);
+
+      if (co->done)
+        {
+          if (__atomic_add_fetch (&finished, 1, __ATOMIC_ACQ_REL) == COROS)
+            {
+              unsigned int i;
+
+              for (i = 0; i < THREADS; ++i)
+                {
+                  pthread_mutex_lock (&threads [i].lock);
+                  pthread_cond_signal (&threads [i].wake);
+                  pthread_mutex_unlock (&threads [i].lock);
+                }
+            }
+
+          continue;
+        }
+
+      if (errno != expect)
+        fail ("errno set on the wrong thread");
+
+      ++co->runs;
+      push (thread->next, co);
+    }
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long count = bench_count (argc, argv, 2000000);
+  unsigned int i;
+  double start;
+
+  runs = count / COROS;
+
+  for (i = 0; i < THREADS; ++i)
+    {
+      pthread_mutex_init (&threads [i].lock, 0);
+      pthread_cond_init (&threads [i].wake, 0);
+      threads [i].head = 0;
+      threads [i].tail = &threads [i].head;
+      threads [i].next = threads + (i + 1) % THREADS;
+    }
+
+  for (i = 0; i < COROS; ++i)
+    {
+      if (!coro_stack_alloc (&coros [i].stack, 0))
+        {
+          perror ("coro_stack_alloc");
+          return 1;
+        }
+
+      coro_create (&coros [i].ctx, migrant, coros + i, coros [i].stack.sptr, coros [i].stack.ssze);
+      push (threads + i % THREADS, coros + i);
+    }
+
+  start = bench_now ();
+
+  for (i = 0; i < THREADS; ++i)
+    pthread_create (&threads [i].id, 0, run, threads + i);
+
+  for (i = 0; i < THREADS; ++i)
+    pthread_join (threads [i].id, 0);
+
+  for (i = 0; i < COROS; ++i)
+    {
+      if (coros [i].runs != runs)
+        fail ("a coroutine was lost");
+
+      coro_destroy (&coros [i].ctx);
+      coro_stack_free (&coros [i].stack);
+    }
+
+  if (failed)
+    return 1;
+
+  bench_report ("migrate", runs * COROS, "ns/migration", (bench_now () - start) / (runs * COROS));
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * The SIGPROF sampler: two coroutines with different entry functions
+ * take turns, one doing three times the work of the other, while the
+ * profiler samples at 1000Hz. Reports the share of the coroutine samples
+ * attributed to the busier one (ideally 75%), and fails if a sample
+ * names the wrong entry function for its context. Then reports the
+ * round-trip latency of two switches with the sampler running, to
+ * compare with switch.
+ */
+
+#include "bench.h"
+
+#define WORK 10000
+#define SAMPLES 100000
+
+static coro_context main_ctx, light_ctx, heavy_ctx;
+static struct coro_profile_sample samples [SAMPLES];
+static volatile unsigned long sink;
+
+static void
+work (unsigned long n)
+{
+  while (n--)
+    sink += n;
+}
+
+static void
+light (void *arg)
+{
+  (void)arg;
+
+  for (;;)
+    {
+      work (WORK);
+      coro_transfer (&light_ctx, &main_ctx);
+    }
+}
+
+static void
+heavy (void *arg)
+{
+  (void)arg;
+
+  for (;;)
+    {
+      work (3 * WORK);
+      coro_transfer (&heavy_ctx, &main_ctx);
+    }
+}
+
+static void
+pong (void *arg)
+{
+  (void)arg;
+
+  for (;;)
+    coro_transfer (&light_ctx, &main_ctx);
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long i;
+  /* volatile, as the setjmp backend would otherwise lose them */
+  volatile unsigned long count = bench_count (argc, argv, 20000);
+  volatile unsigned long nlight = 0, nheavy = 0;
+  struct coro_stack stack1, stack2;
+  size_t taken;
+  double start;
+
+  if (!coro_stack_alloc (&stack1, 0) || !coro_stack_alloc (&stack2, 0))
+    {
+      perror ("coro_stack_alloc");
+      return 1;
+    }
+
+  coro_create (&main_ctx, 0, 0, 0, 0);
+  coro_create (&light_ctx, light, 0, stack1.sptr, stack1.ssze);
+  coro_create (&heavy_ctx, heavy, 0, stack2.sptr, stack2.ssze);
+
+  if (coro_profile_start (1000, samples, SAMPLES) < 0)
+    {
+      perror ("coro_profile_start");
+      return 1;
+    }
+
+  for (i = 0; i < count; ++i)
+    {
+      coro_transfer (&main_ctx, &light_ctx);
+      coro_transfer (&main_ctx, &heavy_ctx);
+    }
+
+  taken = coro_profile_stop ();
+
+  for (i = 0; i < taken; ++i)
+    if (samples [i].ctx == &light_ctx && samples [i].func == light)
+      ++nlight;
+    else if (samples [i].ctx == &heavy_ctx && samples [i].func == heavy)
+      ++nheavy;
+    else if (samples [i].func)
+      {
+        fprintf (stderr, "profile: sample %lu names the wrong entry function\n", i);
+        return 1;
+      }
+
+  if (!(nlight + nheavy))
+    {
+      fprintf (stderr, "profile: no samples\n");
+      return 1;
+    }
+
+  bench_report ("profile-share", nlight + nheavy, "%", 100. * nheavy / (nlight + nheavy));
+
+  coro_destroy (&light_ctx);
+  coro_create (&light_ctx, pong, 0, stack1.sptr, stack1.ssze);
+  coro_profile_start (1000, samples, SAMPLES);
+
+  start = bench_now ();
+
+  for (i = 0; i < count * 500; ++i)
+    coro_transfer (&main_ctx, &light_ctx);
+
+  bench_report ("profile-switch", count * 500, "ns/roundtrip", (bench_now () - start) / (count * 500));
+
+  coro_profile_stop ();
+  coro_destroy (&light_ctx);
+  coro_destroy (&heavy_ctx);
+  coro_stack_free (&stack1);
+  coro_stack_free (&stack2);
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Memory per idle coroutine: create the given number of coroutines, run
+ * each until it yields back, and report how much the resident set grew,
+ * per coroutine. The stacks (16KiB by default, or the second argument in
+ * bytes) are carved out of a single mapping, as one mapping per stack
+ * would hit vm.max_map_count long before a million coroutines.
+ */
+
+#include "bench.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#ifndef MAP_NORESERVE
+# define MAP_NORESERVE 0
+#endif
+
+static coro_context main_ctx;
+
+static void
+park (void *arg)
+{
+  coro_context *self = (coro_context *)arg;
+
+  for (;;)
+    coro_transfer (self, &main_ctx);
+}
+
+/* resident set size in bytes */
+static double
+bench_rss (void)
+{
+  FILE *statm = fopen ("/proc/self/statm", "r");
+  unsigned long size, resident;
+  struct rusage ru;
+
+  if (statm)
+    {
+      int ok = fscanf (statm, "%lu %lu", &size, &resident) == 2;
+
+      fclose (statm);
+
+      if (ok)
+        return (double)resident * sysconf (_SC_PAGESIZE);
+    }
+
+  /* the peak is the best we can do elsewhere, as we never free anything */
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_maxrss * 1024.;
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long i, count = bench_count (argc, argv, 10000);
+  size_t ssze = argc > 2 ? strtoul (argv[2], 0, 0) : 16384;
+  coro_context *ctx;
+  char *stacks;
+  double before;
+  char name[64];
+
+  before = bench_rss ();
+
+  ctx = (coro_context *)calloc (count, sizeof (coro_context));
+  /* only touched pages are committed, or a million stacks need 16GiB */
+  stacks = (char *)mmap (0, count * ssze, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (!ctx || stacks == (char *)MAP_FAILED)
+    {
+      perror ("rss");
+      return 1;
+    }
+
+  coro_create (&main_ctx, 0, 0, 0, 0);
+
+  for (i = 0; i < count; ++i)
+    {
+      coro_create (ctx + i, park, ctx + i, stacks + i * ssze, ssze);
+      coro_transfer (&main_ctx, ctx + i);
+    }
+
+  snprintf (name, sizeof (name), "rss-%lukib", (unsigned long)(ssze / 1024));
+  bench_report (name, count, "bytes/coroutine", (bench_rss () - before) / count);
+
+  return 0;
+}
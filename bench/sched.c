@@ -0,0 +1,53 @@
+/*
+ * Scheduler throughput: spawn a batch of tasks that each yield a few
+ * times, and wait for all of them. Reports nanoseconds per task for the
+ * number of workers given as the second argument (0: one per cpu).
+ */
+
+#include "bench.h"
+#include "corosched.h"
+
+#define YIELDS 4
+
+static void
+task (void *arg)
+{
+  int i;
+
+  (void)arg;
+
+  for (i = 0; i < YIELDS; ++i)
+    coro_sched_yield ();
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long i, count = bench_count (argc, argv, 100000);
+  unsigned int nworkers = argc > 2 ? strtoul (argv[2], 0, 0) : 0;
+  struct coro_sched *sched = coro_sched_new (nworkers);
+  double start;
+
+  if (!sched)
+    {
+      perror ("coro_sched_new");
+      return 1;
+    }
+
+  start = bench_now ();
+
+  for (i = 0; i < count; ++i)
+    if (!coro_sched_spawn (sched, task, 0, 16384))
+      {
+        perror ("coro_sched_spawn");
+        return 1;
+      }
+
+  coro_sched_wait (sched);
+
+  bench_report (nworkers == 1 ? "sched-1" : "sched-n", count, "ns/task", (bench_now () - start) / count);
+
+  coro_sched_free (sched);
+
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Shared stacks: memory per idle coroutine and switch cost when all
+ * coroutines run on one shared stack (coro_asym_create_shared). Creates
+ * the given number of coroutines, resumes each until it yields back and
+ * reports how much the resident set grew, per coroutine (compare with
+ * rss, where every coroutine has a stack of its own). Then reports
+ * nanoseconds per resume/yield round trip of the coroutine whose frames
+ * are on the stack (no copying, compare with switch-asym), round robin
+ * over all of them (two copies each), and round robin over coroutines
+ * that keep a kilobyte of locals live.
+ */
+
+#include "bench.h"
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+static void *
+idle (void *value)
+{
+  for (;;)
+    value = coro_yield (value);
+
+  return 0;
+}
+
+static void *
+deep (void *value)
+{
+  volatile char frame [1024];
+
+  frame [0] = 0;
+
+  for (;;)
+    value = coro_yield ((char *)value + frame [0]);
+
+  return 0;
+}
+
+/* resident set size in bytes, as in rss.c */
+static double
+bench_rss (void)
+{
+  FILE *statm = fopen ("/proc/self/statm", "r");
+  unsigned long size, resident;
+  struct rusage ru;
+
+  if (statm)
+    {
+      int ok = fscanf (statm, "%lu %lu", &size, &resident) == 2;
+
+      fclose (statm);
+
+      if (ok)
+        return (double)resident * sysconf (_SC_PAGESIZE);
+    }
+
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_maxrss * 1024.;
+}
+
+static void
+round_robin (const char *name, coro_asym *co, unsigned long count, unsigned long rounds)
+{
+  unsigned long i, j = 0;
+  double start = bench_now ();
+
+  for (i = 0; i < rounds; ++i)
+    {
+      coro_resume (co + j, 0);
+
+      if (++j == count)
+        j = 0;
+    }
+
+  bench_report (name, rounds, "ns/roundtrip", (bench_now () - start) / rounds);
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long i, count = bench_count (argc, argv, 100000);
+  unsigned long rounds = count < 1000000 ? 1000000 : count;
+  struct coro_shared_stack shared;
+  struct coro_stack stack;
+  coro_asym *co;
+  double before;
+
+  before = bench_rss ();
+
+  co = (coro_asym *)calloc (count, sizeof (coro_asym));
+
+  if (!co || !coro_stack_alloc (&stack, 0))
+    {
+      perror ("shared");
+      return 1;
+    }
+
+  coro_shared_stack_init (&shared, stack.sptr, stack.ssze);
+
+  for (i = 0; i < count; ++i)
+    {
+      coro_asym_create_shared (co + i, idle, &shared);
+      coro_resume (co + i, 0);
+    }
+
+  bench_report ("shared-rss", count, "bytes/coroutine", (bench_rss () - before) / count);
+
+  round_robin ("shared-switch-same", co, 1, rounds);
+  round_robin ("shared-switch", co, count, rounds);
+
+  for (i = 0; i < count; ++i)
+    coro_asym_destroy (co + i);
+
+  for (i = 0; i < count; ++i)
+    {
+      coro_asym_create_shared (co + i, deep, &shared);
+      coro_resume (co + i, 0);
+    }
+
+  round_robin ("shared-switch-1k", co, count, rounds);
+
+  for (i = 0; i < count; ++i)
+    coro_asym_destroy (co + i);
+
+  coro_stack_free (&stack);
+  free (co);
+
+  return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Stack management cost: a coro_stack_alloc/coro_stack_free pair with the
+ * default stack size, touching the top of the stack like a coroutine would.
+ */
+
+#include "bench.h"
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long i, count = bench_count (argc, argv, 100000);
+  struct coro_stack stack;
+  double start;
+
+  start = bench_now ();
+
+  for (i = 0; i < count; ++i)
+    {
+      if (!coro_stack_alloc (&stack, 0))
+        {
+          perror ("coro_stack_alloc");
+          return 1;
+        }
+
+      ((volatile char *)stack.sptr)[stack.ssze - 1] = 0;
+
+      coro_stack_free (&stack);
+    }
+
+  bench_report ("stack", count, "ns/alloc+free", (bench_now () - start) / count);
+
+#if CORO_STACKPOOL
+  {
+    struct coro_stack_pool_stats stats;
+
+    coro_stack_pool_stats (&stats);
+    bench_report ("stack-pool-hits", count, "allocations", stats.hits + stats.global_hits);
+    bench_report ("stack-pool-misses", count, "allocations", stats.misses);
+  }
+#endif
+
+  return 0;
+}
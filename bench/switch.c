@@ -0,0 +1,104 @@
+/*
+ * Switch latency: a coroutine and its creator ping-pong via coro_transfer.
+ * Reports nanoseconds per round trip, i.e. per two switches. The same is
+ * then measured for coro_transfer_value, with the coroutine handing back
+ * what it was passed plus one, as a generator would, and for the same
+ * generator with coro_resume/coro_yield.
+ */
+
+#include "bench.h"
+
+static coro_context main_ctx, coro_ctx, value_ctx;
+
+static void
+pong (void *arg)
+{
+  (void)arg;
+
+  for (;;)
+    coro_transfer (&coro_ctx, &main_ctx);
+}
+
+static void
+pong_value (void *value)
+{
+  for (;;)
+    value = coro_transfer_value (&value_ctx, &main_ctx, (char *)value + 1);
+}
+
+#if CORO_ASYM
+static coro_asym asym;
+
+static void *
+pong_asym (void *value)
+{
+  for (;;)
+    value = coro_yield ((char *)value + 1);
+
+  return 0;
+}
+#endif
+
+int
+main (int argc, char *argv[])
+{
+  unsigned long i, count = bench_count (argc, argv, 10000000);
+  struct coro_stack stack;
+  double start;
+
+  if (!coro_stack_alloc (&stack, 0))
+    {
+      perror ("coro_stack_alloc");
+      return 1;
+    }
+
+  coro_create (&main_ctx, 0, 0, 0, 0);
+  coro_create (&coro_ctx, pong, 0, stack.sptr, stack.ssze);
+
+  /* warm up, and get the coroutine started */
+  for (i = 0; i < count / 100 + 1; ++i)
+    coro_transfer (&main_ctx, &coro_ctx);
+
+  start = bench_now ();
+
+  for (i = 0; i < count; ++i)
+    coro_transfer (&main_ctx, &coro_ctx);
+
+  bench_report ("switch", count, "ns/roundtrip", (bench_now () - start) / count);
+
+  coro_create_value (&value_ctx, pong_value, stack.sptr, stack.ssze);
+
+  for (i = 0; i < count / 100 + 1; ++i)
+    coro_transfer_value (&main_ctx, &value_ctx, 0);
+
+  start = bench_now ();
+
+  for (i = 0; i < count; ++i)
+    if (coro_transfer_value (&main_ctx, &value_ctx, (void *)i) != (void *)(i + 1))
+      {
+        fprintf (stderr, "coro_transfer_value returned the wrong value\n");
+        return 1;
+      }
+
+  bench_report ("switch-value", count, "ns/roundtrip", (bench_now () - start) / count);
+
+#if CORO_ASYM
+  coro_asym_create (&asym, pong_asym, stack.sptr, stack.ssze);
+
+  for (i = 0; i < count / 100 + 1; ++i)
+    coro_resume (&asym, 0);
+
+  start = bench_now ();
+
+  for (i = 0; i < count; ++i)
+    if (coro_resume (&asym, (void *)i) != (void *)(i + 1))
+      {
+        fprintf (stderr, "coro_resume returned the wrong value\n");
+        return 1;
+      }
+
+  bench_report ("switch-asym", count, "ns/roundtrip", (bench_now () - start) / count);
+#endif
+
+  return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * Synchronisation primitives on the scheduler: lock and unlock of a
+ * mutex nobody else wants, eight tasks incrementing a counter under one
+ * mutex, which they hold across a coro_sched_yield every now and then so
+ * that the others queue up, two tasks ping-ponging over a pair of
+ * semaphores, and a producer and a consumer passing values through a
+ * one-slot buffer guarded by a mutex and two condition variables. Each
+ * run is started by a task that waits for the others with a wait group. Reports nanoseconds per operation for the number of
+ * workers given as the second argument (0: one per cpu), and fails if
+ * the counts come out wrong.
+ */
+
+#include "bench.h"
+#include "corosync.h"
+
+#define TASKS 8
+
+static unsigned long count, counter, sum;
+static struct coro_sched *sched;
+static struct coro_mutex mutex;
+static struct coro_cond not_empty, not_full;
+static struct coro_sem ping_sem, pong_sem;
+static struct coro_wait_group wg;
+static unsigned long slot; /* 0 when empty */
+
+static void
+uncontended (void *arg)
+{
+  unsigned long i;
+
+  (void)arg;
+
+  for (i = 0; i < count; ++i)
+    {
+      coro_mutex_lock (&mutex);
+      ++counter;
+      coro_mutex_unlock (&mutex);
+    }
+
+  coro_wait_group_done (&wg);
+}
+
+static void
+contender (void *arg)
+{
+  unsigned long i;
+
+  (void)arg;
+
+  for (i = 0; i < count / TASKS; ++i)
+    {
+      coro_mutex_lock (&mutex);
+
+      if (!(++counter & 15))
+        coro_sched_yield ();
+
+      coro_mutex_unlock (&mutex);
+    }
+
+  coro_wait_group_done (&wg);
+}
+
+static void
+ping (void *arg)
+{
+  unsigned long i;
+
+  (void)arg;
+
+  for (i = 0; i < count; ++i)
+    {
+      coro_sem_post (&ping_sem);
+      coro_sem_wait (&pong_sem);
+    }
+
+  coro_wait_group_done (&wg);
+}
+
+static void
+pong (void *arg)
+{
+  unsigned long i;
+
+  (void)arg;
+
+  for (i = 0; i < count; ++i)
+    {
+      coro_sem_wait (&ping_sem);
+      ++counter;
+      coro_sem_post (&pong_sem);
+    }
+
+  coro_wait_group_done (&wg);
+}
+
+static void
+produce (void *arg)
+{
+  unsigned long i;
+
+  (void)arg;
+
+  for (i = 1; i <= count; ++i)
+    {
+      coro_mutex_lock (&mutex);
+
+      while (slot)
+        coro_cond_wait (&not_full, &mutex);
+
+      slot = i;
+      coro_cond_signal (&not_empty);
+      coro_mutex_unlock (&mutex);
+    }
+
+  coro_wait_group_done (&wg);
+}
+
+static void
+consume (void *arg)
+{
+  unsigned long i;
+
+  (void)arg;
+
+  for (i = 1; i <= count; ++i)
+    {
+      coro_mutex_lock (&mutex);
+
+      while (!slot)
+        coro_cond_wait (&not_empty, &mutex);
+
+      sum += slot;
+      slot = 0;
+      coro_cond_signal (&not_full);
+      coro_mutex_unlock (&mutex);
+    }
+
+  coro_wait_group_done (&wg);
+}
+
+struct job
+{
+  coro_func func, partner; /* partner is optional */
+  unsigned int n;
+};
+
+/* start the tasks of a job and wait for them */
+static void
+start (void *arg)
+{
+  struct job *job = (struct job *)arg;
+  unsigned int i;
+
+  coro_wait_group_add (&wg, job->n + !!job->partner);
+
+  for (i = 0; i < job->n; ++i)
+    coro_sched_spawn (sched, job->func, 0, 0);
+
+  if (job->partner)
+    coro_sched_spawn (sched, job->partner, 0, 0);
+
+  coro_wait_group_wait (&wg);
+}
+
+static int
+run (const char *name, coro_func func, coro_func partner, unsigned int n,
+     unsigned int nworkers, unsigned long expect, unsigned long *got)
+{
+  struct job job;
+  char fullname [64];
+  double begin = bench_now ();
+
+  job.func    = func;
+  job.partner = partner;
+  job.n       = n;
+
+  counter = sum = 0;
+  coro_sched_spawn (sched, start, &job, 0);
+  coro_sched_wait (sched);
+
+  if (*got != expect)
+    {
+      fprintf (stderr, "%s: expected %lu, got %lu\n", name, expect, *got);
+      return 1;
+    }
+
+  snprintf (fullname, sizeof (fullname), "%s-%s", name, nworkers == 1 ? "1" : "n");
+  bench_report (fullname, count, "ns/op", (bench_now () - begin) / count);
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned int nworkers = argc > 2 ? strtoul (argv[2], 0, 0) : 0;
+
+  count = bench_count (argc, argv, 1000000) / TASKS * TASKS;
+  sched = coro_sched_new (nworkers);
+
+  if (!sched)
+    {
+      perror ("coro_sched_new");
+      return 1;
+    }
+
+  coro_mutex_init (&mutex);
+  coro_cond_init (&not_empty);
+  coro_cond_init (&not_full);
+  coro_sem_init (&ping_sem, 0);
+  coro_sem_init (&pong_sem, 0);
+  coro_wait_group_init (&wg);
+
+  if (run ("sync-mutex-free", uncontended, 0, 1, nworkers, count, &counter)
+      || run ("sync-mutex", contender, 0, TASKS, nworkers, count, &counter)
+      || run ("sync-sem", ping, pong, 1, nworkers, count, &counter)
+      || run ("sync-cond", produce, consume, 1, nworkers, count * (count + 1) / 2, &sum))
+    return 1;
+
+  coro_wait_group_destroy (&wg);
+  coro_sem_destroy (&pong_sem);
+  coro_sem_destroy (&ping_sem);
+  coro_cond_destroy (&not_full);
+  coro_cond_destroy (&not_empty);
+  coro_mutex_destroy (&mutex);
+  coro_sched_free (sched);
+
+  return 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * io_uring reactor latency: two coroutines ping-pong a counter, first
+ * over a pair of pipes, then over a loopback TCP connection, which the
+ * coroutines accept and connect themselves. Reports nanoseconds per
+ * round trip, i.e. per two writes and two reads, and fails if a message
+ * comes back wrong.
+ */
+
+#include "bench.h"
+#include "corouring.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static struct coro_uring *ring;
+static unsigned long count;
+static int failed;
+
+static int ping_fd [2], pong_fd [2]; /* fds the pinger resp. ponger reads from and writes to */
+
+static int
+readn (int fd, unsigned long *msg)
+{
+  unsigned int got = 0;
+
+  while (got < sizeof (*msg))
+    {
+      int res = coro_uring_read (ring, fd, (char *)msg + got, sizeof (*msg) - got, -1);
+
+      if (res <= 0)
+        return 0;
+
+      got += res;
+    }
+
+  return 1;
+}
+
+static void
+ping (void *arg)
+{
+  unsigned long i, msg;
+
+  (void)arg;
+
+  for (i = 0; i < count; ++i)
+    if (coro_uring_write (ring, ping_fd [1], &i, sizeof (i), -1) != sizeof (i)
+        || !readn (ping_fd [0], &msg) || msg != i + 1)
+      {
+        failed = 1;
+        break;
+      }
+
+  close (ping_fd [1]);
+}
+
+static void
+pong (void *arg)
+{
+  unsigned long msg;
+
+  (void)arg;
+
+  while (readn (pong_fd [0], &msg))
+    {
+      ++msg;
+
+      if (coro_uring_write (ring, pong_fd [1], &msg, sizeof (msg), -1) != sizeof (msg))
+        {
+          failed = 1;
+          break;
+        }
+    }
+
+  close (pong_fd [1]);
+}
+
+static struct sockaddr_in addr;
+static int listen_fd;
+
+static void
+server (void *arg)
+{
+  int fd = coro_uring_accept (ring, listen_fd, 0, 0);
+
+  (void)arg;
+
+  if (fd < 0)
+    {
+      fprintf (stderr, "accept: %s\n", strerror (-fd));
+      failed = 1;
+      return;
+    }
+
+  pong_fd [0] = pong_fd [1] = fd;
+  pong (0);
+}
+
+static void
+client (void *arg)
+{
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+  int one = 1, res;
+
+  (void)arg;
+
+  res = coro_uring_connect (ring, fd, (struct sockaddr *)&addr, sizeof (addr));
+
+  if (res < 0)
+    {
+      fprintf (stderr, "connect: %s\n", strerror (-res));
+      failed = 1;
+      return;
+    }
+
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+  ping_fd [0] = ping_fd [1] = fd;
+  ping (0);
+}
+
+static int
+run (const char *name, coro_func a, coro_func b)
+{
+  double start = bench_now ();
+
+  if (!coro_uring_spawn (ring, a, 0, 0) || !coro_uring_spawn (ring, b, 0, 0))
+    {
+      perror ("coro_uring_spawn");
+      return 1;
+    }
+
+  if (coro_uring_run (ring) < 0)
+    {
+      perror ("coro_uring_run");
+      return 1;
+    }
+
+  if (failed)
+    {
+      fprintf (stderr, "%s: message lost or corrupted\n", name);
+      return 1;
+    }
+
+  bench_report (name, count, "ns/roundtrip", (bench_now () - start) / count);
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  socklen_t len = sizeof (addr);
+  int p1 [2], p2 [2];
+
+  count = bench_count (argc, argv, 100000);
+  ring = coro_uring_new (0);
+
+  if (!ring)
+    {
+      perror ("coro_uring_new");
+      return 1;
+    }
+
+  if (pipe (p1) || pipe (p2))
+    {
+      perror ("pipe");
+      return 1;
+    }
+
+  ping_fd [0] = p2 [0]; ping_fd [1] = p1 [1];
+  pong_fd [0] = p1 [0]; pong_fd [1] = p2 [1];
+
+  if (run ("uring-pipe", ping, pong))
+    return 1;
+
+  close (p1 [0]);
+  close (p2 [0]);
+
+  listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (listen_fd < 0
+      || bind (listen_fd, (struct sockaddr *)&addr, sizeof (addr))
+      || listen (listen_fd, 1)
+      || getsockname (listen_fd, (struct sockaddr *)&addr, &len))
+    {
+      perror ("listen");
+      return 1;
+    }
+
+  if (run ("uring-tcp", server, client))
+    return 1;
+
+  close (listen_fd);
+  coro_uring_free (ring);
+
+  return 0;
+}
@@ -43,6 +43,304 @@
 #include <stddef.h>
 #include <string.h>
 
+/*****************************************************************************/
+/* statistics                                                                */
+/*****************************************************************************/
+#if CORO_STATS
+
+# include <pthread.h>
+
+# if defined __has_include
+#  if __has_include (<sys/sdt.h>)
+#   include <sys/sdt.h>
+#   define CORO_SDT 1
+#  endif
+# endif
+
+# if CORO_SDT
+#  define CORO_PROBE2(name,a,b)   DTRACE_PROBE2 (libcoro, name, a, b)
+#  define CORO_PROBE3(name,a,b,c) DTRACE_PROBE3 (libcoro, name, a, b, c)
+# else
+#  define CORO_PROBE2(name,a,b)   ((void)(a), (void)(b))
+#  define CORO_PROBE3(name,a,b,c) ((void)(a), (void)(b), (void)(c))
+# endif
+
+/*
+ * Every thread counts into its own structure, without any atomic
+ * read-modify-write, and links it into a global list on first use, so
+ * coro_stats can add them up. Threads that exit add theirs to
+ * coro_stats_exited.
+ */
+struct coro_stats_list
+{
+  struct coro_stats stats;
+  struct coro_stats_list *next, **prev;
+};
+
+static __thread struct coro_stats_list coro_stats_local;
+static __thread int coro_stats_registered;
+
+static struct coro_stats_list *coro_stats_threads;
+static struct coro_stats coro_stats_exited;
+static pthread_mutex_t coro_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t coro_stats_key;
+static pthread_once_t coro_stats_once = PTHREAD_ONCE_INIT;
+
+static void
+coro_stats_add (struct coro_stats *sum, struct coro_stats *stats)
+{
+  sum->transfers    += __atomic_load_n (&stats->transfers   , __ATOMIC_RELAXED);
+  sum->creates      += __atomic_load_n (&stats->creates     , __ATOMIC_RELAXED);
+  sum->stack_allocs += __atomic_load_n (&stats->stack_allocs, __ATOMIC_RELAXED);
+  sum->stack_frees  += __atomic_load_n (&stats->stack_frees , __ATOMIC_RELAXED);
+}
+
+static void
+coro_stats_exit (void *arg)
+{
+  struct coro_stats_list *self = (struct coro_stats_list *)arg;
+
+  pthread_mutex_lock (&coro_stats_mutex);
+
+  coro_stats_add (&coro_stats_exited, &self->stats);
+
+  if ((*self->prev = self->next))
+    self->next->prev = self->prev;
+
+  pthread_mutex_unlock (&coro_stats_mutex);
+}
+
+static void
+coro_stats_init (void)
+{
+  pthread_key_create (&coro_stats_key, coro_stats_exit);
+}
+
+static struct coro_stats *
+coro_stats_self (void)
+{
+  struct coro_stats_list *self = &coro_stats_local;
+
+  if (!coro_stats_registered)
+    {
+      pthread_once (&coro_stats_once, coro_stats_init);
+      pthread_setspecific (coro_stats_key, self);
+
+      pthread_mutex_lock (&coro_stats_mutex);
+
+      if ((self->next = coro_stats_threads))
+        self->next->prev = &self->next;
+
+      self->prev = &coro_stats_threads;
+      coro_stats_threads = self;
+
+      pthread_mutex_unlock (&coro_stats_mutex);
+
+      coro_stats_registered = 1;
+    }
+
+  return &self->stats;
+}
+
+/* only the owning thread writes, others may read at any time */
+# define CORO_STATS_COUNT(counter) do {                                   \
+    struct coro_stats *stats_ = coro_stats_self ();                       \
+    __atomic_store_n (&stats_->counter, stats_->counter + 1, __ATOMIC_RELAXED); \
+  } while (0)
+
+void
+coro_stats_switch (coro_context *prev, coro_context *next)
+{
+  CORO_STATS_COUNT (transfers);
+  CORO_PROBE2 (transfer, prev, next);
+# if CORO_PROFILE
+  coro_profile_switch (prev, next);
+# endif
+}
+
+void
+coro_stats (struct coro_stats *stats)
+{
+  struct coro_stats_list *thread;
+
+  pthread_mutex_lock (&coro_stats_mutex);
+
+  *stats = coro_stats_exited;
+
+  for (thread = coro_stats_threads; thread; thread = thread->next)
+    coro_stats_add (stats, &thread->stats);
+
+  pthread_mutex_unlock (&coro_stats_mutex);
+}
+
+void
+coro_stats_thread (struct coro_stats *stats)
+{
+  memset (stats, 0, sizeof (*stats));
+  coro_stats_add (stats, coro_stats_self ());
+}
+
+#else
+# define CORO_STATS_COUNT(counter) ((void)0)
+# define CORO_PROBE2(name,a,b)     ((void)(a), (void)(b))
+# define CORO_PROBE3(name,a,b,c)   ((void)(a), (void)(b), (void)(c))
+#endif
+
+/* a coroutine (not an empty context) was created */
+#define CORO_STATS_CREATE(ctx,sptr,ssze) do { \
+    CORO_STATS_COUNT (creates);               \
+    CORO_PROBE3 (create, ctx, sptr, ssze);    \
+  } while (0)
+
+/*****************************************************************************/
+/* profiling                                                                 */
+/*****************************************************************************/
+#if CORO_PROFILE
+
+# include <errno.h>
+# include <signal.h>
+# include <sys/time.h>
+# if __linux__
+#  include <ucontext.h>
+# endif
+
+/*
+ * The signal handler reads these on the interrupted thread, initial-exec
+ * keeps that free of __tls_get_addr. The entry function is copied, so
+ * the handler never touches a context that might be gone.
+ */
+static __thread coro_context *coro_profile_ctx __attribute__ ((__tls_model__ ("initial-exec")));
+static __thread coro_func coro_profile_func __attribute__ ((__tls_model__ ("initial-exec")));
+
+static struct coro_profile_sample *coro_profile_samples;
+static size_t coro_profile_count, coro_profile_taken;
+static struct sigaction coro_profile_osa;
+
+void
+coro_profile_switch (coro_context *prev, coro_context *next)
+{
+  (void)prev;
+
+  /* a signal in between attributes a sample to the new function, but the old context */
+  coro_profile_func = next->profile_entry;
+  coro_profile_ctx  = next;
+}
+
+static void *
+coro_profile_pc (void *uc_)
+{
+# if __linux__
+  ucontext_t *uc = (ucontext_t *)uc_;
+
+#  if __x86_64__
+  return (void *)uc->uc_mcontext.gregs[16]; /* REG_RIP */
+#  elif __i386__
+  return (void *)uc->uc_mcontext.gregs[14]; /* REG_EIP */
+#  elif __aarch64__
+  return (void *)uc->uc_mcontext.pc;
+#  elif __arm__
+  return (void *)uc->uc_mcontext.arm_pc;
+#  elif __riscv
+  return (void *)uc->uc_mcontext.__gregs[0]; /* REG_PC */
+#  endif
+# endif
+
+  (void)uc_;
+  return 0;
+}
+
+static void
+coro_profile_sigprof (int signum, siginfo_t *si, void *uc)
+{
+  size_t i = __atomic_fetch_add (&coro_profile_taken, 1, __ATOMIC_RELAXED);
+
+  (void)signum;
+  (void)si;
+
+  if (i < coro_profile_count)
+    {
+      coro_profile_samples [i].ctx  = coro_profile_ctx;
+      coro_profile_samples [i].func = coro_profile_func;
+      coro_profile_samples [i].pc   = coro_profile_pc (uc);
+    }
+}
+
+int
+coro_profile_start (unsigned int hz, struct coro_profile_sample *samples, size_t count)
+{
+  struct sigaction sa;
+  struct itimerval it;
+
+  if (!hz || hz > 1000000)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  coro_profile_samples = samples;
+  coro_profile_count   = count;
+  coro_profile_taken   = 0;
+
+  sa.sa_sigaction = coro_profile_sigprof;
+  sa.sa_flags     = SA_SIGINFO | SA_RESTART;
+  sigemptyset (&sa.sa_mask);
+
+  if (sigaction (SIGPROF, &sa, &coro_profile_osa) < 0)
+    return -1;
+
+  it.it_interval.tv_sec  = 1000000 / hz / 1000000;
+  it.it_interval.tv_usec = 1000000 / hz % 1000000;
+  it.it_value = it.it_interval;
+
+  if (setitimer (ITIMER_PROF, &it, 0) < 0)
+    {
+      sigaction (SIGPROF, &coro_profile_osa, 0);
+      return -1;
+    }
+
+  return 0;
+}
+
+size_t
+coro_profile_stop (void)
+{
+  struct itimerval it;
+  size_t taken;
+
+  memset (&it, 0, sizeof (it));
+  setitimer (ITIMER_PROF, &it, 0);
+  sigaction (SIGPROF, &coro_profile_osa, 0);
+
+  taken = __atomic_load_n (&coro_profile_taken, __ATOMIC_RELAXED);
+
+  return taken < coro_profile_count ? taken : coro_profile_count;
+}
+
+# define CORO_PROFILE_CREATE(ctx,coro) ((ctx)->profile_entry = (coro))
+#else
+# define CORO_PROFILE_CREATE(ctx,coro) ((void)0)
+#endif
+
+/*
+ * Makes unwinders (debuggers, profilers, exception handling) stop at the
+ * first frame of a coroutine, instead of running off into whatever lies
+ * below it on its stack.
+ */
+#if __GCC_HAVE_DWARF2_CFI_ASM && !(_WIN32 || __CYGWIN__)
+# if __x86_64__
+#  define CORO_CFI_OUTERMOST "\t.cfi_undefined rip\n"
+# elif __i386__
+#  define CORO_CFI_OUTERMOST "\t.cfi_undefined eip\n"
+# elif __aarch64__
+#  define CORO_CFI_OUTERMOST "\t.cfi_undefined x30\n"
+# elif __arm__
+#  define CORO_CFI_OUTERMOST "\t.cfi_undefined r14\n"
+# elif __riscv
+#  define CORO_CFI_OUTERMOST "\t.cfi_undefined ra\n"
+# endif
+#endif
+
 /*****************************************************************************/
 /* ucontext/setjmp/asm backends                                              */
 /*****************************************************************************/
@@ -52,6 +350,10 @@
 #  include <stddef.h>
 # endif
 
+# if CORO_UCONTEXT_FAST
+#  include <signal.h>
+# endif
+
 # if !defined(STACK_ADJUST_PTR)
 #  if __sgi
 /* IRIX is decidedly NON-unix */
@@ -77,6 +379,8 @@
 #  include <unistd.h>
 # endif
 
+# if !CORO_ASM
+
 static coro_func coro_init_func;
 static void *coro_init_arg;
 static coro_context *new_coro, *create_coro;
@@ -89,21 +393,122 @@ coro_init (void)
 
   coro_transfer (new_coro, create_coro);
 
-#if __GCC_HAVE_DWARF2_CFI_ASM && __amd64
-  /*asm (".cfi_startproc");*/
-  /*asm (".cfi_undefined rip");*/
+#ifdef CORO_CFI_OUTERMOST
+  __asm__ __volatile__ (CORO_CFI_OUTERMOST);
 #endif
 
   func ((void *)arg);
 
-#if __GCC_HAVE_DWARF2_CFI_ASM && __amd64
-  /*asm (".cfi_endproc");*/
-#endif
-
   /* the new coro returned. bad. just abort() for now */
   abort ();
 }
 
+# endif
+
+# if CORO_SJLJ && !defined CORO_SJLJ_PIVOT
+#  if __GNUC__ && ((__x86_64__ && !__ILP32__ && !_WIN32 && !__CYGWIN__) || (__i386__ && !_WIN32 && !__CYGWIN__) \
+      || __aarch64__ || (__riscv && __riscv_xlen == 64))
+#   define CORO_SJLJ_PIVOT 1
+#  endif
+# endif
+
+# if CORO_SJLJ_PIVOT
+
+/*
+ * Call fn (arg) with the stack pointer set to sp, then switch back to the
+ * original stack. This is all that is needed to create a new coroutine
+ * with setjmp, without signals or globals.
+ */
+  asm (
+       "\t.text\n"
+       "coro_sjlj_pivot:\n"
+       #if __x86_64__
+
+         "\tpushq %rbp\n"
+         "\tmovq %rsp, %rbp\n"
+         "\tmovq %rdx, %rsp\n"
+         "\tcallq *%rsi\n"
+         "\tmovq %rbp, %rsp\n"
+         "\tpopq %rbp\n"
+         "\tret\n"
+
+       #elif __i386__
+
+         "\tpushl %ebp\n"
+         "\tmovl %esp, %ebp\n"
+         "\tmovl 8(%ebp), %eax\n"
+         "\tmovl 12(%ebp), %ecx\n"
+         "\tmovl 16(%ebp), %esp\n"
+         "\tsubl $12, %esp\n"
+         "\tpushl %eax\n"
+         "\tcalll *%ecx\n"
+         "\tmovl %ebp, %esp\n"
+         "\tpopl %ebp\n"
+         "\tret\n"
+
+       #elif __aarch64__
+
+         "\tstp x29, x30, [sp, #-16]!\n"
+         "\tmov x29, sp\n"
+         "\tmov sp, x2\n"
+         "\tblr x1\n"
+         "\tmov sp, x29\n"
+         "\tldp x29, x30, [sp], #16\n"
+         "\tret\n"
+
+       #elif __riscv
+
+         "\taddi sp, sp, -16\n"
+         "\tsd ra, 8(sp)\n"
+         "\tsd s0, 0(sp)\n"
+         "\tmv s0, sp\n"
+         "\tmv sp, a2\n"
+         "\tjalr a1\n"
+         "\tmv sp, s0\n"
+         "\tld s0, 0(sp)\n"
+         "\tld ra, 8(sp)\n"
+         "\taddi sp, sp, 16\n"
+         "\tret\n"
+
+       #endif
+  );
+
+void coro_sjlj_pivot (void *arg, void (*fn)(void *), void *sp) asm ("coro_sjlj_pivot");
+
+struct coro_sjlj_start
+{
+  coro_context *ctx;
+  coro_func func;
+  void *arg;
+};
+
+/*
+ * Runs on the new stack. Like the signal trampoline, it returns after
+ * the setjmp, and the coroutine is later started by longjmp'ing back into
+ * its (otherwise untouched) frame.
+ */
+static void
+coro_sjlj_bootstrap (void *start_)
+{
+  struct coro_sjlj_start *start = (struct coro_sjlj_start *)start_;
+  volatile coro_func func = start->func;
+  void *volatile arg = start->arg;
+
+  if (coro_setjmp (start->ctx->env))
+    {
+#ifdef CORO_CFI_OUTERMOST
+      /* coro_sjlj_pivot has long returned */
+      __asm__ __volatile__ (CORO_CFI_OUTERMOST);
+#endif
+      func ((void *)arg);
+
+      /* the new coro returned. bad. just abort() for now */
+      abort ();
+    }
+}
+
+# endif
+
 # if CORO_SJLJ
 
 static volatile int trampoline_done;
@@ -120,7 +525,7 @@ trampoline (int sig)
 
 # endif
 
-# if CORO_ASM
+# if CORO_ASM || CORO_UCONTEXT_FAST
 
   #if __arm__ && \
       (defined __ARM_ARCH_7__  || defined __ARM_ARCH_7A__ \
@@ -133,22 +538,45 @@ trampoline (int sig)
     #define CORO_WIN_TIB 1
   #endif
 
+  /* with CORO_UCONTEXT_FAST, coro_transfer is a C wrapper around the switcher */
+  #if CORO_ASM
+    #define CORO_SWITCH "coro_transfer"
+  #else
+    #define CORO_SWITCH "coro_uc_switch"
+  #endif
+
   asm (
        "\t.text\n"
+       /* coro_transfer_value is the same code, the switcher always returns its third argument */
        #if _WIN32 || __CYGWIN__
-       "\t.globl _coro_transfer\n"
-       "_coro_transfer:\n"
+       #if CORO_ASM
+       "\t.globl _coro_transfer_value\n"
+       "_coro_transfer_value:\n"
+       #endif
+       "\t.globl _" CORO_SWITCH "\n"
+       "_" CORO_SWITCH ":\n"
        #else
-       "\t.globl coro_transfer\n"
-       "coro_transfer:\n"
+       #if CORO_ASM
+       "\t.globl coro_transfer_value\n"
+       "coro_transfer_value:\n"
+       #endif
+       "\t.globl " CORO_SWITCH "\n"
+       CORO_SWITCH ":\n"
        #endif
        /* windows, of course, gives a shit on the amd64 ABI and uses different registers */
        /* http://blogs.msdn.com/freik/archive/2005/03/17/398200.aspx */
        #if __amd64
 
+         #if __CET__ & 1
+           "\tendbr64\n" /* it might be called through a pointer */
+         #endif
          #if _WIN32 || __CYGWIN__
-           #define NUM_SAVED 29
-           "\tsubq $168, %rsp\t" /* one dummy qword to improve alignment */
+           #if CORO_WIN_TIB
+             #define NUM_SAVED (29 + 3)
+           #else
+             #define NUM_SAVED 29
+           #endif
+           "\tsubq $168, %rsp\n" /* one dummy qword to improve alignment */
            "\tmovaps %xmm6, (%rsp)\n"
            "\tmovaps %xmm7, 16(%rsp)\n"
            "\tmovaps %xmm8, 32(%rsp)\n"
@@ -198,22 +626,55 @@ trampoline (int sig)
            "\tmovaps 128(%rsp), %xmm14\n"
            "\tmovaps 144(%rsp), %xmm15\n"
            "\taddq $168, %rsp\n"
+           "\tmovq %r8, %rax\n"
          #else
-           #define NUM_SAVED 6
+           #define NUM_SAVED (6 + CORO_SHSTK)
            "\tpushq %rbp\n"
            "\tpushq %rbx\n"
            "\tpushq %r12\n"
            "\tpushq %r13\n"
            "\tpushq %r14\n"
            "\tpushq %r15\n"
+           #if CORO_SHSTK
+             /*
+              * The shadow stack pointer goes into the frame, 0 when the kernel
+              * does not enforce shadow stacks, as rdssp is a nop then. The
+              * restore token rstorssp checks for was left by saveprevssp when
+              * that shadow stack was switched away from, or by the kernel or
+              * coro_shstk_prime for new ones.
+              */
+             "\txorl %ecx, %ecx\n"
+             "\trdsspq %rcx\n"
+             "\tpushq %rcx\n"
+           #endif
            "\tmovq %rsp, (%rdi)\n"
            "\tmovq (%rsi), %rsp\n"
+           #if CORO_SHSTK
+             "\tpopq %rcx\n"
+             "\ttestq %rcx, %rcx\n"
+             "\tjz 1f\n"
+             "\trstorssp -8(%rcx)\n"
+             "\tsaveprevssp\n"
+             "1:\n"
+           #endif
            "\tpopq %r15\n"
            "\tpopq %r14\n"
            "\tpopq %r13\n"
            "\tpopq %r12\n"
            "\tpopq %rbx\n"
            "\tpopq %rbp\n"
+           "\tmovq %rdx, %rax\n"
+         #endif
+         #if CORO_SHSTK
+           /*
+            * The return address is on top of the new shadow stack as well,
+            * so ret checks it. That always mispredicts, so it is only used
+            * when it has to be.
+            */
+           "\ttestq %rcx, %rcx\n"
+           "\tjz 2f\n"
+           "\tret\n"
+           "2:\n"
          #endif
          "\tpopq %rcx\n"
          "\tjmpq *%rcx\n"
@@ -233,6 +694,7 @@ trampoline (int sig)
            "\tpushl %fs:8\n"
          #endif
          "\tmovl %esp, (%eax)\n"
+         "\tmovl %ecx, %eax\n" /* coro_transfer_value is regparm(3) */
          "\tmovl (%edx), %esp\n"
          #if CORO_WIN_TIB
            "\tpopl %fs:8\n"
@@ -256,6 +718,7 @@ trampoline (int sig)
          #endif
          "\tpush {r4-r11,lr}\n"
          "\tstr sp, [r0]\n"
+         "\tmov r0, r2\n"
          "\tldr sp, [r1]\n"
          "\tpop {r4-r11,lr}\n"
          #if __ARM_PCS_VFP
@@ -263,6 +726,103 @@ trampoline (int sig)
          #endif
          "\tmov r15, lr\n"
 
+       #elif __aarch64__
+
+         #define NUM_SAVED 20
+         "\thint #34\n" /* bti c */
+         "\tsub sp, sp, #160\n"
+         "\tstp x19, x20, [sp, #0]\n"
+         "\tstp x21, x22, [sp, #16]\n"
+         "\tstp x23, x24, [sp, #32]\n"
+         "\tstp x25, x26, [sp, #48]\n"
+         "\tstp x27, x28, [sp, #64]\n"
+         "\tstp x29, x30, [sp, #80]\n"
+         "\tstp d8, d9, [sp, #96]\n"
+         "\tstp d10, d11, [sp, #112]\n"
+         "\tstp d12, d13, [sp, #128]\n"
+         "\tstp d14, d15, [sp, #144]\n"
+         "\tmov x3, sp\n"
+         "\tstr x3, [x0]\n"
+         "\tldr x3, [x1]\n"
+         "\tmov sp, x3\n"
+         "\tmov x0, x2\n"
+         "\tldp x19, x20, [sp, #0]\n"
+         "\tldp x21, x22, [sp, #16]\n"
+         "\tldp x23, x24, [sp, #32]\n"
+         "\tldp x25, x26, [sp, #48]\n"
+         "\tldp x27, x28, [sp, #64]\n"
+         "\tldp x29, x30, [sp, #80]\n"
+         "\tldp d8, d9, [sp, #96]\n"
+         "\tldp d10, d11, [sp, #112]\n"
+         "\tldp d12, d13, [sp, #128]\n"
+         "\tldp d14, d15, [sp, #144]\n"
+         "\tadd sp, sp, #160\n"
+         "\tret\n"
+
+       #elif __riscv && __riscv_xlen == 64
+
+         #define NUM_SAVED 26 /* ra, s0-s11, fs0-fs11, one for alignment */
+         "\taddi sp, sp, -208\n"
+         "\tsd ra, 0(sp)\n"
+         "\tsd s0, 8(sp)\n"
+         "\tsd s1, 16(sp)\n"
+         "\tsd s2, 24(sp)\n"
+         "\tsd s3, 32(sp)\n"
+         "\tsd s4, 40(sp)\n"
+         "\tsd s5, 48(sp)\n"
+         "\tsd s6, 56(sp)\n"
+         "\tsd s7, 64(sp)\n"
+         "\tsd s8, 72(sp)\n"
+         "\tsd s9, 80(sp)\n"
+         "\tsd s10, 88(sp)\n"
+         "\tsd s11, 96(sp)\n"
+         #if __riscv_flen >= 64
+           "\tfsd fs0, 104(sp)\n"
+           "\tfsd fs1, 112(sp)\n"
+           "\tfsd fs2, 120(sp)\n"
+           "\tfsd fs3, 128(sp)\n"
+           "\tfsd fs4, 136(sp)\n"
+           "\tfsd fs5, 144(sp)\n"
+           "\tfsd fs6, 152(sp)\n"
+           "\tfsd fs7, 160(sp)\n"
+           "\tfsd fs8, 168(sp)\n"
+           "\tfsd fs9, 176(sp)\n"
+           "\tfsd fs10, 184(sp)\n"
+           "\tfsd fs11, 192(sp)\n"
+         #endif
+         "\tsd sp, 0(a0)\n"
+         "\tld sp, 0(a1)\n"
+         "\tmv a0, a2\n"
+         "\tld ra, 0(sp)\n"
+         "\tld s0, 8(sp)\n"
+         "\tld s1, 16(sp)\n"
+         "\tld s2, 24(sp)\n"
+         "\tld s3, 32(sp)\n"
+         "\tld s4, 40(sp)\n"
+         "\tld s5, 48(sp)\n"
+         "\tld s6, 56(sp)\n"
+         "\tld s7, 64(sp)\n"
+         "\tld s8, 72(sp)\n"
+         "\tld s9, 80(sp)\n"
+         "\tld s10, 88(sp)\n"
+         "\tld s11, 96(sp)\n"
+         #if __riscv_flen >= 64
+           "\tfld fs0, 104(sp)\n"
+           "\tfld fs1, 112(sp)\n"
+           "\tfld fs2, 120(sp)\n"
+           "\tfld fs3, 128(sp)\n"
+           "\tfld fs4, 136(sp)\n"
+           "\tfld fs5, 144(sp)\n"
+           "\tfld fs6, 152(sp)\n"
+           "\tfld fs7, 160(sp)\n"
+           "\tfld fs8, 168(sp)\n"
+           "\tfld fs9, 176(sp)\n"
+           "\tfld fs10, 184(sp)\n"
+           "\tfld fs11, 192(sp)\n"
+         #endif
+         "\taddi sp, sp, 208\n"
+         "\tret\n"
+
        #elif __mips__ && 0 /* untested, 32 bit only */
 
         #define NUM_SAVED (12 + 8 * 2)
@@ -325,70 +885,394 @@ trampoline (int sig)
        #endif
   );
 
-# endif
+  /*
+   * A new coroutine starts here, "returned" to by coro_transfer. coro_create
+   * stores the entry function, its argument and abort in callee-saved
+   * registers and aligns the stack, so no globals and no switch are needed.
+   * coro_create_value enters at coro_startup_value instead, which replaces
+   * the argument by the value the switcher returned.
+   */
+  asm (
+       "\t.text\n"
+       #if CORO_SHSTK
+         /*
+          * Switch to the new shadow stack and call coro_shstk_primed right
+          * in front of coro_startup(_value), so that address ends up on the
+          * new shadow stack, for the switcher to return to.
+          */
+         "coro_shstk_prime:\n"
+         "\trdsspq %rdx\n"
+         "\trstorssp -8(%rdi)\n"
+         "\tsaveprevssp\n"
+         "\ttestl %esi, %esi\n"
+         "\tjz 1f\n"
+         "\tcallq coro_shstk_primed\n"
+       #endif
+       #ifdef CORO_CFI_OUTERMOST
+         "\t.cfi_startproc\n"
+         CORO_CFI_OUTERMOST
+       #endif
+       "coro_startup_value:\n"
+       #if __amd64
+         "\tmovq %rax, %r13\n"
+         #if CORO_SHSTK
+           "\tjmp coro_startup\n"
+           "1:\n"
+           "\tcallq coro_shstk_primed\n"
+         #endif
+       #elif __i386__
+         "\tmovl %eax, %esi\n"
+       #elif CORO_ARM
+         "\tmov r5, r0\n"
+       #elif __aarch64__
+         "\tmov x20, x0\n"
+       #elif __riscv
+         "\tmv s2, a0\n"
+       #endif
+       "coro_startup:\n"
+       #if __amd64
+         #if _WIN32 || __CYGWIN__
+           "\tmovq %r13, %rcx\n"
+           "\tsubq $32, %rsp\n" /* register parameter area */
+         #else
+           "\tmovq %r13, %rdi\n"
+         #endif
+         "\tcallq *%r12\n"
+         "\tcallq *%rbx\n"
 
-void
-coro_create (coro_context *ctx, coro_func coro, void *arg, void *sptr, size_t ssize)
-{
-  coro_context nctx;
-# if CORO_SJLJ
-  stack_t ostk, nstk;
-  struct sigaction osa, nsa;
-  sigset_t nsig, osig;
-# endif
+       #elif __i386__
 
-  if (!coro)
-    return;
+         "\tsubl $12, %esp\n"
+         "\tpushl %esi\n"
+         "\tcalll *%edi\n"
+         "\tcalll *%ebx\n"
 
-  coro_init_func = coro;
-  coro_init_arg  = arg;
+       #elif CORO_ARM
 
-  new_coro    = ctx;
-  create_coro = &nctx;
+         "\tmov r0, r5\n"
+         "\tblx r4\n"
+         "\tblx r6\n"
 
-# if CORO_SJLJ
-  /* we use SIGUSR2. first block it, then fiddle with it. */
+       #elif __aarch64__
 
-  sigemptyset (&nsig);
-  sigaddset (&nsig, SIGUSR2);
-  sigprocmask (SIG_BLOCK, &nsig, &osig);
+         "\tmov x0, x20\n"
+         "\tblr x19\n"
+         "\tblr x21\n"
 
-  nsa.sa_handler = trampoline;
-  sigemptyset (&nsa.sa_mask);
-  nsa.sa_flags = SA_ONSTACK;
+       #elif __riscv
 
-  if (sigaction (SIGUSR2, &nsa, &osa))
-    {
-      perror ("sigaction");
-      abort ();
-    }
+         "\tmv a0, s2\n"
+         "\tjalr s1\n"
+         "\tjalr s3\n"
 
-  /* set the new stack */
-  nstk.ss_sp    = STACK_ADJUST_PTR (sptr, ssize); /* yes, some platforms (IRIX) get this wrong. */
-  nstk.ss_size  = STACK_ADJUST_SIZE (sptr, ssize);
-  nstk.ss_flags = 0;
+       #endif
+       #ifdef CORO_CFI_OUTERMOST
+         "\t.cfi_endproc\n"
+       #endif
+       #if CORO_SHSTK
+         /* drop the return address from the normal stack only and switch back */
+         "coro_shstk_primed:\n"
+         "\taddq $8, %rsp\n"
+         "\trdsspq %rax\n"
+         "\trstorssp -8(%rdx)\n"
+         "\tsaveprevssp\n"
+         "\tret\n"
+       #endif
+  );
 
-  if (sigaltstack (&nstk, &ostk) < 0)
-    {
-      perror ("sigaltstack");
-      abort ();
-    }
+void coro_startup (void) asm ("coro_startup");
+void coro_startup_value (void) asm ("coro_startup_value");
 
-  trampoline_done = 0;
-  kill (getpid (), SIGUSR2);
-  sigfillset (&nsig); sigdelset (&nsig, SIGUSR2);
+#  if CORO_SHSTK
 
-  while (!trampoline_done)
-    sigsuspend (&nsig);
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
 
-  sigaltstack (0, &nstk);
-  nstk.ss_flags = SS_DISABLE;
-  if (sigaltstack (&nstk, 0) < 0)
-    perror ("sigaltstack");
+#   ifndef __NR_map_shadow_stack
+#    define __NR_map_shadow_stack 453
+#   endif
+#   ifndef SHADOW_STACK_SET_TOKEN
+#    define SHADOW_STACK_SET_TOKEN 1
+#   endif
 
-  sigaltstack (0, &nstk);
-  if (~nstk.ss_flags & SS_DISABLE)
-    abort ();
+void *coro_shstk_prime (void *ssp, int value) asm ("coro_shstk_prime");
+
+/*
+ * When the kernel enforces shadow stacks, give a new coroutine one of its
+ * own, with a restore token and the address of coro_startup(_value) on
+ * it. Returns the shadow stack pointer for the new frame, or 0. Stack
+ * frames are at least 16 bytes, and each needs 8 on the shadow stack.
+ */
+static void *
+coro_shstk_create (coro_context *ctx, int value, size_t ssize)
+{
+  void *ssp = 0;
+  size_t page;
+
+  ctx->ss = 0;
+  ctx->ss_size = 0;
+
+  /* a nop when shadow stacks are off */
+  __asm__ __volatile__ ("rdsspq %0" : "+r" (ssp));
+
+  if (!ssp)
+    return 0;
+
+  page = sysconf (_SC_PAGESIZE);
+  ctx->ss_size = (ssize / 2 + page - 1) & ~(page - 1);
+  ctx->ss = (void *)syscall (__NR_map_shadow_stack, 0, ctx->ss_size, SHADOW_STACK_SET_TOKEN);
+
+  if (ctx->ss == MAP_FAILED)
+    abort ();
+
+  return coro_shstk_prime ((char *)ctx->ss + ctx->ss_size, value);
+}
+
+void
+coro_destroy (coro_context *ctx)
+{
+  if (ctx->ss)
+    munmap (ctx->ss, ctx->ss_size);
+
+  ctx->ss = 0;
+}
+
+#  endif
+
+/*
+ * Lay out a frame at the top of the given stack that coro_transfer will
+ * "return" into, starting coro (arg) via start, which is coro_startup or
+ * coro_startup_value. Returns the stack pointer to store in the
+ * coro_context.
+ */
+static void **
+coro_startup_frame (void (*start)(void), coro_func coro, void *arg, void *sptr, size_t ssize)
+{
+  void **sp;
+
+  #if CORO_WIN_TIB
+    #define TIB_SAVED 3
+  #else
+    #define TIB_SAVED 0
+  #endif
+
+  /* the shadow stack pointer, filled in by coro_create */
+  #if CORO_SHSTK
+    #define SSP_SAVED 1
+  #else
+    #define SSP_SAVED 0
+  #endif
+
+  sp = (void **)(((size_t)sptr + ssize) & ~(size_t)15);
+
+  #if __i386__ || __x86_64__
+    *--sp = (void *)start;
+  #elif CORO_ARM || __aarch64__ || __riscv
+    /* return address stored in lr register, don't push anything */
+  #else
+    #error unsupported architecture
+  #endif
+
+  sp -= NUM_SAVED;
+  memset (sp, 0, sizeof (*sp) * NUM_SAVED);
+
+  #if CORO_WIN_TIB
+    sp[0] = sptr;                 /* StackLimit */
+    sp[1] = (char *)sptr + ssize; /* StackBase */
+    sp[2] = 0;                    /* ExceptionList */
+  #endif
+
+  #if __amd64
+    sp[TIB_SAVED + SSP_SAVED + 2] = arg;           /* r13 */
+    sp[TIB_SAVED + SSP_SAVED + 3] = coro;          /* r12 */
+    sp[TIB_SAVED + SSP_SAVED + 4] = (void *)abort; /* rbx */
+  #elif __i386__
+    sp[TIB_SAVED + 0] = coro;          /* edi */
+    sp[TIB_SAVED + 1] = arg;           /* esi */
+    sp[TIB_SAVED + 2] = (void *)abort; /* ebx */
+  #elif CORO_ARM
+    sp[0] = coro;                      /* r4 */
+    sp[1] = arg;                       /* r5 */
+    sp[2] = (void *)abort;             /* r6 */
+    sp[8] = (void *)start;             /* lr */
+  #elif __aarch64__
+    sp[0] = coro;                      /* x19 */
+    sp[1] = arg;                       /* x20 */
+    sp[2] = (void *)abort;             /* x21 */
+    sp[11] = (void *)start;            /* x30 */
+  #elif __riscv
+    sp[0] = (void *)start;             /* ra */
+    sp[2] = coro;                      /* s1 */
+    sp[3] = arg;                       /* s2 */
+    sp[4] = (void *)abort;             /* s3 */
+  #else
+    #error unsupported architecture
+  #endif
+
+  return sp;
+}
+
+# endif
+
+# if CORO_UCONTEXT_FAST
+
+#  if __i386__
+void __attribute__ ((__noinline__, __regparm__(2)))
+#  else
+void __attribute__ ((__noinline__))
+#  endif
+coro_uc_switch (coro_context *prev, coro_context *next);
+
+/* switch to the makecontext'ed context when a coroutine is first entered */
+static void
+coro_uc_start (void *uc)
+{
+  setcontext ((ucontext_t *)uc);
+  abort ();
+}
+
+/* kept out of line, so the common case is a tail call to the switcher */
+static void __attribute__ ((__noinline__))
+coro_uc_transfer_sigmask (coro_context *prev, coro_context *next)
+{
+  sigset_t mask;
+
+  sigprocmask (SIG_SETMASK, 0, &mask);
+  coro_uc_switch (prev, next);
+  sigprocmask (SIG_SETMASK, &mask, 0);
+}
+
+void
+coro_transfer (coro_context *prev, coro_context *next)
+{
+  CORO_STATS_SWITCH (prev, next);
+
+  if (prev->sigmask)
+    coro_uc_transfer_sigmask (prev, next);
+  else
+    coro_uc_switch (prev, next);
+}
+
+# endif
+
+# if CORO_ASM
+
+void
+coro_create (coro_context *ctx, coro_func coro, void *arg, void *sptr, size_t ssize)
+{
+#if CORO_SHSTK
+  ctx->ss = 0;
+#endif
+  CORO_PROFILE_CREATE (ctx, coro);
+
+  if (!coro)
+    return;
+
+  CORO_STATS_CREATE (ctx, sptr, ssize);
+  ctx->sp = coro_startup_frame (coro_startup, coro, arg, sptr, ssize);
+#if CORO_SHSTK
+  ctx->sp[0] = coro_shstk_create (ctx, 0, ssize);
+#endif
+}
+
+void
+coro_create_value (coro_context *ctx, coro_func coro, void *sptr, size_t ssize)
+{
+  CORO_STATS_CREATE (ctx, sptr, ssize);
+  CORO_PROFILE_CREATE (ctx, coro);
+  ctx->sp = coro_startup_frame (coro_startup_value, coro, 0, sptr, ssize);
+#if CORO_SHSTK
+  ctx->sp[0] = coro_shstk_create (ctx, 1, ssize);
+#endif
+}
+
+# else
+
+void
+coro_create (coro_context *ctx, coro_func coro, void *arg, void *sptr, size_t ssize)
+{
+  coro_context nctx;
+# if CORO_SJLJ
+  stack_t ostk, nstk;
+  struct sigaction osa, nsa;
+  sigset_t nsig, osig;
+# endif
+
+# if CORO_UCONTEXT_FAST
+  ctx->sp      = 0;
+  ctx->sigmask = 0;
+  nctx.sigmask = 0;
+# endif
+  CORO_PROFILE_CREATE (ctx, coro);
+
+  if (!coro)
+    return;
+
+  CORO_STATS_CREATE (ctx, sptr, ssize);
+
+# if CORO_SJLJ_PIVOT
+  {
+    struct coro_sjlj_start start;
+
+    start.ctx  = ctx;
+    start.func = coro;
+    start.arg  = arg;
+
+    coro_sjlj_pivot (&start, coro_sjlj_bootstrap, (void *)(((size_t)sptr + ssize) & ~(size_t)15));
+    return;
+  }
+# endif
+
+  coro_init_func = coro;
+  coro_init_arg  = arg;
+
+  new_coro    = ctx;
+  create_coro = &nctx;
+
+# if CORO_SJLJ
+  /* we use SIGUSR2. first block it, then fiddle with it. */
+
+  sigemptyset (&nsig);
+  sigaddset (&nsig, SIGUSR2);
+  sigprocmask (SIG_BLOCK, &nsig, &osig);
+
+  nsa.sa_handler = trampoline;
+  sigemptyset (&nsa.sa_mask);
+  nsa.sa_flags = SA_ONSTACK;
+
+  if (sigaction (SIGUSR2, &nsa, &osa))
+    {
+      perror ("sigaction");
+      abort ();
+    }
+
+  /* set the new stack */
+  nstk.ss_sp    = STACK_ADJUST_PTR (sptr, ssize); /* yes, some platforms (IRIX) get this wrong. */
+  nstk.ss_size  = STACK_ADJUST_SIZE (sptr, ssize);
+  nstk.ss_flags = 0;
+
+  if (sigaltstack (&nstk, &ostk) < 0)
+    {
+      perror ("sigaltstack");
+      abort ();
+    }
+
+  trampoline_done = 0;
+  kill (getpid (), SIGUSR2);
+  sigfillset (&nsig); sigdelset (&nsig, SIGUSR2);
+
+  while (!trampoline_done)
+    sigsuspend (&nsig);
+
+  sigaltstack (0, &nstk);
+  nstk.ss_flags = SS_DISABLE;
+  if (sigaltstack (&nstk, 0) < 0)
+    perror ("sigaltstack");
+
+  sigaltstack (0, &nstk);
+  if (~nstk.ss_flags & SS_DISABLE)
+    abort ();
 
   if (~ostk.ss_flags & SS_DISABLE)
     sigaltstack (&ostk, 0);
@@ -446,36 +1330,6 @@ coro_create (coro_context *ctx, coro_func coro, void *arg, void *sptr, size_t ss
   ctx->env[JB_PC]                      = (__uint64_t)coro_init;
   ctx->env[JB_SP]                      = (__uint64_t)STACK_ADJUST_PTR (sptr, ssize) - sizeof (long);
 
-# elif CORO_ASM
-
-  #if __i386__ || __x86_64__
-    ctx->sp = (void **)(ssize + (char *)sptr);
-    *--ctx->sp = (void *)abort; /* needed for alignment only */
-    *--ctx->sp = (void *)coro_init;
-    #if CORO_WIN_TIB
-      *--ctx->sp = 0;                    /* ExceptionList */
-      *--ctx->sp = (char *)sptr + ssize; /* StackBase */
-      *--ctx->sp = sptr;                 /* StackLimit */
-    #endif
-  #elif CORO_ARM
-    /* return address stored in lr register, don't push anything */
-  #else
-    #error unsupported architecture
-  #endif
-
-  ctx->sp -= NUM_SAVED;
-  memset (ctx->sp, 0, sizeof (*ctx->sp) * NUM_SAVED);
-
-  #if __i386__ || __x86_64__
-    /* done already */
-  #elif CORO_ARM
-    ctx->sp[0] = coro; /* r4 */
-    ctx->sp[1] = arg;  /* r5 */
-    ctx->sp[8] = (char *)coro_init; /* lr */
-  #else
-    #error unsupported architecture
-  #endif
-
 # elif CORO_UCONTEXT
 
   getcontext (&(ctx->uc));
@@ -487,19 +1341,27 @@ coro_create (coro_context *ctx, coro_func coro, void *arg, void *sptr, size_t ss
 
   makecontext (&(ctx->uc), (void (*)())coro_init, 0);
 
+  #if CORO_UCONTEXT_FAST
+    /*
+     * The first switch into the coroutine goes to a frame at the bottom of
+     * its stack, which setcontext's into the context made above. That part
+     * of the stack is free until the coroutine recurses deeply.
+     */
+    ctx->sp = coro_startup_frame (coro_startup, coro_uc_start, &ctx->uc, sptr, ssize / 2 < 4096 ? ssize / 2 : 4096);
+  #endif
+
 # endif
 
   coro_transfer (create_coro, new_coro);
 }
 
+# endif
+
 /*****************************************************************************/
 /* pthread backend                                                           */
 /*****************************************************************************/
 #elif CORO_PTHREAD
 
-/* this mutex will be locked by the running coroutine */
-pthread_mutex_t coro_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 struct coro_init_args
 {
   coro_func func;
@@ -520,96 +1382,240 @@ coro_init (void *args_)
   return 0;
 }
 
-void
-coro_transfer (coro_context *prev, coro_context *next)
+#if CORO_PTHREAD_FUTEX
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Every context has its own futex word, so a transfer only ever touches
+ * the two contexts involved. A thread sets its word to CORO_SLEEPING
+ * before it goes to sleep in the kernel, so waking it up is only
+ * necessary (and only costs a system call) if it did.
+ */
+#define CORO_WAIT     0
+#define CORO_RUN      1
+#define CORO_EXIT     2
+#define CORO_SLEEPING 3
+
+#ifndef CORO_PTHREAD_SPIN
+# define CORO_PTHREAD_SPIN 0
+#endif
+
+static void
+coro_futex_wake (coro_context *ctx, int flags)
 {
-  pthread_mutex_lock (&coro_mutex);
+  if (__atomic_exchange_n (&ctx->flags, flags, __ATOMIC_ACQ_REL) == CORO_SLEEPING)
+    syscall (SYS_futex, &ctx->flags, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+}
 
-  next->flags = 1;
-  pthread_cond_signal (&next->cv);
+/* wait until ctx may run, exit the thread if it is destroyed instead */
+static void
+coro_futex_wait (coro_context *ctx)
+{
+  int flags;
 
-  prev->flags = 0;
+  #if CORO_PTHREAD_SPIN
+    int spin;
 
-  while (!prev->flags)
-    pthread_cond_wait (&prev->cv, &coro_mutex);
+    for (spin = CORO_PTHREAD_SPIN; spin; --spin)
+      {
+        if ((flags = __atomic_load_n (&ctx->flags, __ATOMIC_ACQUIRE)))
+          goto done;
+
+        #if __i386__ || __x86_64__
+          __asm__ __volatile__ ("pause");
+        #elif __aarch64__ || __arm__
+          __asm__ __volatile__ ("yield");
+        #endif
+      }
+  #endif
 
-  if (prev->flags == 2)
+  flags = CORO_WAIT;
+
+  if (__atomic_compare_exchange_n (&ctx->flags, &flags, CORO_SLEEPING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    while ((flags = __atomic_load_n (&ctx->flags, __ATOMIC_ACQUIRE)) == CORO_SLEEPING)
+      syscall (SYS_futex, &ctx->flags, FUTEX_WAIT_PRIVATE, CORO_SLEEPING, 0, 0, 0);
+
+#if CORO_PTHREAD_SPIN
+done:
+#endif
+  if (flags == CORO_EXIT)
     {
-      pthread_mutex_unlock (&coro_mutex);
-      pthread_cond_destroy (&prev->cv);
       pthread_detach (pthread_self ());
       pthread_exit (0);
     }
+}
 
-  pthread_mutex_unlock (&coro_mutex);
+void
+coro_transfer (coro_context *prev, coro_context *next)
+{
+  CORO_STATS_SWITCH (prev, next);
+  __atomic_store_n (&prev->flags, CORO_WAIT, __ATOMIC_RELAXED);
+  coro_futex_wake (next, CORO_RUN);
+  coro_futex_wait (prev);
 }
 
 void
 coro_create (coro_context *ctx, coro_func coro, void *arg, void *sptr, size_t ssize)
 {
-  static coro_context nctx;
-  static int once;
-
-  if (!once)
-    {
-      once = 1;
-
-      pthread_cond_init (&nctx.cv, 0);
-    }
-
-  pthread_cond_init (&ctx->cv, 0);
+  ctx->flags = CORO_WAIT;
 
   if (coro)
     {
       pthread_attr_t attr;
       struct coro_init_args args;
+      coro_context nctx;
       pthread_t id;
 
+      CORO_STATS_CREATE (ctx, sptr, ssize);
+
       args.func = coro;
       args.arg  = arg;
       args.self = ctx;
       args.main = &nctx;
 
+      nctx.flags = CORO_WAIT;
+
       pthread_attr_init (&attr);
 #if __UCLIBC__
       /* exists, but is borked */
       /*pthread_attr_setstacksize (&attr, (size_t)ssize);*/
-#elif __CYGWIN__
-      /* POSIX, not here */
-      pthread_attr_setstacksize (&attr, (size_t)ssize);
 #else
       pthread_attr_setstack (&attr, sptr, (size_t)ssize);
 #endif
       pthread_attr_setscope (&attr, PTHREAD_SCOPE_PROCESS);
       pthread_create (&id, &attr, coro_init, &args);
-
-      coro_transfer (args.main, args.self);
+      pthread_attr_destroy (&attr);
+
+      /*
+       * wait for the new thread to transfer back to us. its wakeup may
+       * still hit nctx after we returned, which is harmless, as all
+       * futex waits re-check their word.
+       */
+      coro_futex_wait (&nctx);
     }
 }
 
 void
 coro_destroy (coro_context *ctx)
 {
-  pthread_mutex_lock (&coro_mutex);
-  ctx->flags = 2;
-  pthread_cond_signal (&ctx->cv);
-  pthread_mutex_unlock (&coro_mutex);
+  coro_futex_wake (ctx, CORO_EXIT);
 }
 
-/*****************************************************************************/
-/* fiber backend                                                             */
-/*****************************************************************************/
-#elif CORO_FIBER
+#else
 
-#define WIN32_LEAN_AND_MEAN
-#if _WIN32_WINNT < 0x0400
-  #undef _WIN32_WINNT
-  #define _WIN32_WINNT 0x0400
-#endif
-#include <windows.h>
+/* this mutex will be locked by the running coroutine */
+pthread_mutex_t coro_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-VOID CALLBACK
-coro_init (PVOID arg)
+void
+coro_transfer (coro_context *prev, coro_context *next)
+{
+  CORO_STATS_SWITCH (prev, next);
+  pthread_mutex_lock (&coro_mutex);
+
+  next->flags = 1;
+  pthread_cond_signal (&next->cv);
+
+  prev->flags = 0;
+
+  while (!prev->flags)
+    pthread_cond_wait (&prev->cv, &coro_mutex);
+
+  if (prev->flags == 2)
+    {
+      pthread_mutex_unlock (&coro_mutex);
+      pthread_cond_destroy (&prev->cv);
+      pthread_detach (pthread_self ());
+      pthread_exit (0);
+    }
+
+  pthread_mutex_unlock (&coro_mutex);
+}
+
+void
+coro_create (coro_context *ctx, coro_func coro, void *arg, void *sptr, size_t ssize)
+{
+  static coro_context nctx;
+  static int once;
+
+  if (!once)
+    {
+      once = 1;
+
+      pthread_cond_init (&nctx.cv, 0);
+    }
+
+  pthread_cond_init (&ctx->cv, 0);
+
+  if (coro)
+    {
+      pthread_attr_t attr;
+      struct coro_init_args args;
+      pthread_t id;
+
+      CORO_STATS_CREATE (ctx, sptr, ssize);
+
+      args.func = coro;
+      args.arg  = arg;
+      args.self = ctx;
+      args.main = &nctx;
+
+      pthread_attr_init (&attr);
+#if __UCLIBC__
+      /* exists, but is borked */
+      /*pthread_attr_setstacksize (&attr, (size_t)ssize);*/
+#elif __CYGWIN__
+      /* POSIX, not here */
+      pthread_attr_setstacksize (&attr, (size_t)ssize);
+#else
+      pthread_attr_setstack (&attr, sptr, (size_t)ssize);
+#endif
+      pthread_attr_setscope (&attr, PTHREAD_SCOPE_PROCESS);
+
+      /*
+       * wait for the new thread to transfer back to us. the mutex must be
+       * held from before it starts, or its wakeup could come before we wait.
+       */
+      pthread_mutex_lock (&coro_mutex);
+      nctx.flags = 0;
+
+      pthread_create (&id, &attr, coro_init, &args);
+      pthread_attr_destroy (&attr);
+
+      while (!nctx.flags)
+        pthread_cond_wait (&nctx.cv, &coro_mutex);
+
+      pthread_mutex_unlock (&coro_mutex);
+    }
+}
+
+void
+coro_destroy (coro_context *ctx)
+{
+  pthread_mutex_lock (&coro_mutex);
+  ctx->flags = 2;
+  pthread_cond_signal (&ctx->cv);
+  pthread_mutex_unlock (&coro_mutex);
+}
+
+#endif
+
+/*****************************************************************************/
+/* fiber backend                                                             */
+/*****************************************************************************/
+#elif CORO_FIBER
+
+#define WIN32_LEAN_AND_MEAN
+#if _WIN32_WINNT < 0x0400
+  #undef _WIN32_WINNT
+  #define _WIN32_WINNT 0x0400
+#endif
+#include <windows.h>
+
+VOID CALLBACK
+coro_init (PVOID arg)
 {
   coro_context *ctx = (coro_context *)arg;
 
@@ -619,6 +1625,8 @@ coro_init (PVOID arg)
 void
 coro_transfer (coro_context *prev, coro_context *next)
 {
+  CORO_STATS_SWITCH (prev, next);
+
   if (!prev->fiber)
     {
       prev->fiber = GetCurrentFiber ();
@@ -636,10 +1644,12 @@ coro_create (coro_context *ctx, coro_func coro, void *arg, void *sptr, size_t ss
   ctx->fiber = 0;
   ctx->coro  = coro;
   ctx->arg   = arg;
+  CORO_PROFILE_CREATE (ctx, coro);
 
   if (!coro)
     return;
 
+  CORO_STATS_CREATE (ctx, sptr, ssize);
   ctx->fiber = CreateFiber (ssize, coro_init, ctx);
 }
 
@@ -653,6 +1663,266 @@ coro_destroy (coro_context *ctx)
   #error unsupported backend
 #endif
 
+/*****************************************************************************/
+/* value passing, emulated in the context for all but CORO_ASM               */
+/*****************************************************************************/
+#if !CORO_ASM
+
+static void
+coro_value_start (void *arg)
+{
+  coro_context *ctx = (coro_context *)arg;
+
+  ctx->value_coro (ctx->value);
+}
+
+void
+coro_create_value (coro_context *ctx, coro_func coro, void *sptr, size_t ssize)
+{
+  ctx->value      = 0;
+  ctx->value_coro = coro;
+  coro_create (ctx, coro_value_start, ctx, sptr, ssize);
+  CORO_PROFILE_CREATE (ctx, coro);
+}
+
+void *
+coro_transfer_value (coro_context *prev, coro_context *next, void *value)
+{
+  next->value = value;
+  coro_transfer (prev, next);
+
+  return prev->value;
+}
+
+#endif
+
+/*****************************************************************************/
+/* moving coroutines between threads                                         */
+/*****************************************************************************/
+
+#include <errno.h>
+
+/* out of line, and not constant as far as the compiler knows, see coro.h */
+CORO_NOINLINE int *
+coro_errno_location (void)
+{
+  CORO_COMPILER_BARRIER ();
+  return &errno;
+}
+
+/*****************************************************************************/
+/* asymmetric coroutines                                                     */
+/*****************************************************************************/
+#if CORO_ASYM
+
+#include <stdlib.h>
+
+/*
+ * initial-exec avoids a __tls_get_addr call per access when this is
+ * compiled as PIC, which would cost more than the switch itself.
+ */
+#if __GNUC__
+# define CORO_ASYM_THREAD __thread __attribute__ ((__tls_model__ ("initial-exec")))
+#elif _MSC_VER
+# define CORO_ASYM_THREAD __declspec (thread)
+#else
+# define CORO_ASYM_THREAD _Thread_local
+#endif
+
+static CORO_ASYM_THREAD coro_asym *coro_asym_running;
+
+/*
+ * Whoever switches away hands the current coroutine over to the other
+ * side before the switch, so coro_resume and coro_yield can tail-call the
+ * switcher. Code after the switch would return through a return address
+ * that the cpu's return predictor does not expect, which costs a
+ * misprediction per function return and made resume/yield several times
+ * slower than coro_transfer. It also means the thread-local variable is
+ * never accessed on a different thread than the one its address was
+ * computed on.
+ *
+ * With CORO_PTHREAD, every coroutine runs on a thread of its own, so each
+ * side has to set its own thread's variable after the switch.
+ */
+
+/* the out-of-line switcher, even with CORO_INLINE_SWITCH, to keep the tail calls */
+#if CORO_ASM
+# define coro_asym_switch(prev,next,value) (CORO_STATS_SWITCH ((prev), (next)), (coro_transfer_value) ((prev), (next), (value)))
+#else
+# define coro_asym_switch(prev,next,value) coro_transfer_value ((prev), (next), (value))
+#endif
+
+static void
+coro_asym_start (void *arg)
+{
+  coro_asym *co = (coro_asym *)arg;
+  void *result;
+
+#if CORO_PTHREAD
+  coro_asym_running = co;
+#endif
+
+  result = co->func (co->value);
+
+  co->status = CORO_ASYM_DONE;
+  coro_asym_running = co->resumer;
+  coro_asym_switch (&co->ctx, &co->caller, result);
+
+  /* coro_resume never switches to a finished coroutine */
+  abort ();
+}
+
+void
+coro_asym_create (coro_asym *co, coro_asym_func func, void *sptr, size_t ssze)
+{
+  co->resumer = 0;
+  co->func    = func;
+  co->value   = 0;
+  co->status  = CORO_ASYM_NEW;
+#if CORO_ASM
+  co->shared  = 0;
+  co->saved   = 0;
+#endif
+
+  coro_create (&co->caller, 0, 0, 0, 0);
+  coro_create (&co->ctx, coro_asym_start, co, sptr, ssze);
+}
+
+void
+coro_asym_destroy (coro_asym *co)
+{
+#if CORO_ASM
+  if (co->shared && co->shared->owner == co)
+    co->shared->owner = 0;
+
+  free (co->saved);
+#endif
+
+  coro_destroy (&co->ctx);
+  coro_destroy (&co->caller);
+}
+
+#if CORO_ASM
+
+void
+coro_shared_stack_init (struct coro_shared_stack *stack, void *sptr, size_t ssze)
+{
+  stack->sptr  = sptr;
+  stack->ssze  = ssze;
+  stack->owner = 0;
+}
+
+void
+coro_asym_create_shared (coro_asym *co, coro_asym_func func, struct coro_shared_stack *stack)
+{
+  co->resumer     = 0;
+  co->func        = func;
+  co->value       = 0;
+  co->status      = CORO_ASYM_NEW;
+  co->shared      = stack;
+  co->saved       = 0;
+  co->saved_size  = 0;
+  co->saved_alloc = 0;
+
+  /* the stack is in use, the frame is laid out when it is first resumed */
+  coro_create (&co->caller, 0, 0, 0, 0);
+  coro_create (&co->ctx, 0, 0, 0, 0);
+}
+
+/*
+ * Make the shared stack co's, saving the frames of the coroutine that ran
+ * there last: everything between its saved stack pointer and the top of
+ * the stack. Buffers only ever grow, to the deepest suspension so far.
+ */
+static void __attribute__ ((__noinline__))
+coro_shared_switch (coro_asym *co)
+{
+  struct coro_shared_stack *stack = co->shared;
+  coro_asym *owner = stack->owner;
+  char *top = (char *)stack->sptr + stack->ssze;
+
+  if (owner && owner->status == CORO_ASYM_RUNNING)
+    abort (); /* its frames are in use */
+
+  if (owner && owner->status == CORO_ASYM_SUSPENDED)
+    {
+      char *sp = (char *)owner->ctx.sp;
+
+      owner->saved_size = top - sp;
+
+      if (owner->saved_size > owner->saved_alloc)
+        {
+          free (owner->saved);
+          owner->saved_alloc = owner->saved_size;
+
+          if (!(owner->saved = malloc (owner->saved_alloc)))
+            abort ();
+        }
+
+      memcpy (owner->saved, sp, owner->saved_size);
+    }
+
+  if (co->status == CORO_ASYM_NEW)
+    coro_create (&co->ctx, coro_asym_start, co, stack->sptr, stack->ssze);
+  else
+    memcpy (top - co->saved_size, co->saved, co->saved_size);
+
+  stack->owner = co;
+}
+
+#endif
+
+void *
+coro_resume (coro_asym *co, void *value)
+{
+  if (co->status == CORO_ASYM_NEW)
+    co->value = value;
+  else if (co->status != CORO_ASYM_SUSPENDED)
+    return 0;
+
+#if CORO_ASM
+  if (co->shared && co->shared->owner != co)
+    coro_shared_switch (co);
+#endif
+
+  co->resumer = coro_asym_running;
+  co->status  = CORO_ASYM_RUNNING;
+  coro_asym_running = co;
+
+#if CORO_PTHREAD
+  value = coro_asym_switch (&co->caller, &co->ctx, value);
+  coro_asym_running = co->resumer;
+  return value;
+#else
+  return coro_asym_switch (&co->caller, &co->ctx, value);
+#endif
+}
+
+void *
+coro_yield (void *value)
+{
+  coro_asym *co = coro_asym_running;
+
+  co->status = CORO_ASYM_SUSPENDED;
+  coro_asym_running = co->resumer;
+
+#if CORO_PTHREAD
+  value = coro_asym_switch (&co->ctx, &co->caller, value);
+  coro_asym_running = co;
+  return value;
+#else
+  return coro_asym_switch (&co->ctx, &co->caller, value);
+#endif
+}
+
+coro_asym *
+coro_asym_current (void)
+{
+  return coro_asym_running;
+}
+
+#endif
+
 /*****************************************************************************/
 /* stack management                                                          */
 /*****************************************************************************/
@@ -695,7 +1965,7 @@ coro_destroy (coro_context *ctx)
 # undef CORO_GUARDPAGES
 #endif
 
-#if !__i386__ && !__x86_64__ && !__powerpc__ && !__arm__ && !__aarch64__ && !__m68k__ && !__alpha__ && !__mips__ && !__sparc64__
+#if !__i386__ && !__x86_64__ && !__powerpc__ && !__arm__ && !__aarch64__ && !__m68k__ && !__alpha__ && !__mips__ && !__sparc64__ && !__riscv
 # undef CORO_GUARDPAGES
 #endif
 
@@ -722,25 +1992,16 @@ coro_destroy (coro_context *ctx)
   #endif
 #endif
 
-int
-coro_stack_alloc (struct coro_stack *stack, unsigned int size)
-{
-  if (!size)
-    size = 256 * 1024;
-
-  stack->sptr = 0;
-  stack->ssze = ((size_t)size * sizeof (void *) + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
-
-#if CORO_FIBER
-
-  stack->sptr = (void *)stack;
-  return 1;
-
-#else
+#if !CORO_FIBER
 
-  size_t ssze = stack->ssze + CORO_GUARDPAGES * PAGESIZE;
+/* map a stack of ssze usable bytes, preceded by the guard pages */
+static void *
+coro_stack_map (size_t ssze)
+{
   void *base;
 
+  ssze += CORO_GUARDPAGES * PAGESIZE;
+
   #if CORO_MMAP
     /* mmap supposedly does allocate-on-write for us */
     base = mmap (0, ssze, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -762,39 +2023,824 @@ coro_stack_alloc (struct coro_stack *stack, unsigned int size)
     base = (void*)((char *)base + CORO_GUARDPAGES * PAGESIZE);
   #else
     base = malloc (ssze);
-    if (!base)
-      return 0;
-  #endif
-
-  #if CORO_USE_VALGRIND
-    stack->valgrind_id = VALGRIND_STACK_REGISTER ((char *)base, ((char *)base) + ssze - CORO_GUARDPAGES * PAGESIZE);
   #endif
 
-  stack->sptr = base;
-  return 1;
-
-#endif
+  return base;
 }
 
-void
-coro_stack_free (struct coro_stack *stack)
+static void
+coro_stack_unmap (void *sptr, size_t ssze)
 {
-#if CORO_FIBER
-  /* nop */
-#else
-  #if CORO_USE_VALGRIND
-    VALGRIND_STACK_DEREGISTER (stack->valgrind_id);
-  #endif
-
   #if CORO_MMAP
-    if (stack->sptr)
-      munmap ((void*)((char *)stack->sptr - CORO_GUARDPAGES * PAGESIZE),
-              stack->ssze                 + CORO_GUARDPAGES * PAGESIZE);
+    if (sptr)
+      munmap ((void*)((char *)sptr - CORO_GUARDPAGES * PAGESIZE),
+              ssze                 + CORO_GUARDPAGES * PAGESIZE);
   #else
-    free (stack->sptr);
+    free (sptr);
   #endif
-#endif
 }
 
+#if CORO_MMAP && defined MADV_DONTNEED
+# define CORO_RECLAIM 1
+#else
+# define CORO_RECLAIM 0
 #endif
 
+/* release all but the topmost keep bytes of a stack, return how much was released */
+static size_t
+coro_stack_advise (void *sptr, size_t ssze, size_t keep)
+{
+  #if CORO_RECLAIM
+    size_t len;
+
+    keep = (keep + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+
+    if (!sptr || keep >= ssze)
+      return 0;
+
+    len = ssze - keep;
+
+    #if CORO_STACKRECLAIM_LAZY && defined MADV_FREE
+      /* MADV_FREE is only supported by Linux 4.5 and newer */
+      if (!madvise (sptr, len, MADV_FREE))
+        return len;
+    #endif
+
+    return madvise (sptr, len, MADV_DONTNEED) ? 0 : len;
+  #else
+    (void)sptr; (void)ssze; (void)keep;
+    return 0;
+  #endif
+}
+
+#if CORO_STACKPOOL
+
+#include <pthread.h>
+
+#ifndef CORO_STACKPOOL_GLOBAL
+# define CORO_STACKPOOL_GLOBAL (4 * CORO_STACKPOOL)
+#endif
+
+/* size class n holds stacks of PAGESIZE << n bytes */
+#define CORO_POOL_CLASSES 24
+
+/*
+ * Pooled stacks are linked through their topmost word, which is the
+ * part of the stack most likely to be resident already.
+ */
+#define CORO_POOL_LINK(sptr,ssze) (*(void **)((char *)(sptr) + (ssze) - sizeof (void *)))
+
+struct coro_pool_list
+{
+  void *head;
+  unsigned int count; /* global lists: changed under the lock, peeked at without it */
+  unsigned int low;   /* global lists: the lowest count since the trimmer last looked */
+};
+
+static __thread struct coro_pool_list coro_pool_local [CORO_POOL_CLASSES];
+static __thread int coro_pool_registered;
+
+static struct coro_pool_list coro_pool_global [CORO_POOL_CLASSES];
+static pthread_mutex_t coro_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t coro_pool_key;
+static pthread_once_t coro_pool_once = PTHREAD_ONCE_INIT;
+
+static struct coro_stack_pool_stats coro_pool_stats;
+
+#define CORO_POOL_COUNT(counter) __atomic_fetch_add (&coro_pool_stats.counter, 1, __ATOMIC_RELAXED)
+
+static int
+coro_pool_class (size_t ssze)
+{
+  int cls = 0;
+
+  while (cls < CORO_POOL_CLASSES && (size_t)PAGESIZE << cls < ssze)
+    ++cls;
+
+  return cls;
+}
+
+static void *
+coro_pool_pop (struct coro_pool_list *list, size_t ssze)
+{
+  void *sptr = list->head;
+
+  if (sptr)
+    {
+      list->head = CORO_POOL_LINK (sptr, ssze);
+      __atomic_store_n (&list->count, list->count - 1, __ATOMIC_RELAXED);
+
+      if (list->low > list->count)
+        list->low = list->count;
+    }
+
+  return sptr;
+}
+
+static void
+coro_pool_push (struct coro_pool_list *list, void *sptr, size_t ssze)
+{
+  CORO_POOL_LINK (sptr, ssze) = list->head;
+  list->head = sptr;
+  __atomic_store_n (&list->count, list->count + 1, __ATOMIC_RELAXED);
+}
+
+/* move as many stacks as fit into the global list, unmap the rest */
+static void
+coro_pool_flush (struct coro_pool_list *local)
+{
+  int cls;
+
+  pthread_mutex_lock (&coro_pool_mutex);
+
+  for (cls = 0; cls < CORO_POOL_CLASSES; ++cls)
+    {
+      size_t ssze = (size_t)PAGESIZE << cls;
+      void *sptr;
+
+      while ((sptr = coro_pool_pop (local + cls, ssze)))
+        if (coro_pool_global [cls].count < CORO_STACKPOOL_GLOBAL)
+          coro_pool_push (coro_pool_global + cls, sptr, ssze);
+        else
+          coro_stack_unmap (sptr, ssze);
+    }
+
+  pthread_mutex_unlock (&coro_pool_mutex);
+}
+
+static void
+coro_pool_thread_exit (void *local)
+{
+  coro_pool_flush ((struct coro_pool_list *)local);
+}
+
+static void
+coro_pool_init (void)
+{
+  pthread_key_create (&coro_pool_key, coro_pool_thread_exit);
+}
+
+static void *
+coro_pool_get (int cls, size_t ssze)
+{
+  void *sptr = coro_pool_pop (coro_pool_local + cls, ssze);
+
+  if (sptr)
+    {
+      CORO_POOL_COUNT (hits);
+      return sptr;
+    }
+
+  /* unlocked peek, a stale value merely costs us a miss or a lock */
+  if (__atomic_load_n (&coro_pool_global [cls].count, __ATOMIC_RELAXED))
+    {
+      pthread_mutex_lock (&coro_pool_mutex);
+      sptr = coro_pool_pop (coro_pool_global + cls, ssze);
+      pthread_mutex_unlock (&coro_pool_mutex);
+
+      if (sptr)
+        {
+          CORO_POOL_COUNT (global_hits);
+          return sptr;
+        }
+    }
+
+  CORO_POOL_COUNT (misses);
+  return 0;
+}
+
+static int
+coro_pool_put (int cls, void *sptr, size_t ssze)
+{
+  #if CORO_STACKRECLAIM
+    coro_stack_advise (sptr, ssze, CORO_STACKRECLAIM);
+  #endif
+
+  if (coro_pool_local [cls].count < CORO_STACKPOOL)
+    {
+      /* make sure the thread's list gets flushed when it exits */
+      if (!coro_pool_registered)
+        {
+          pthread_once (&coro_pool_once, coro_pool_init);
+          pthread_setspecific (coro_pool_key, coro_pool_local);
+          coro_pool_registered = 1;
+        }
+
+      coro_pool_push (coro_pool_local + cls, sptr, ssze);
+      CORO_POOL_COUNT (releases);
+      return 1;
+    }
+
+  pthread_mutex_lock (&coro_pool_mutex);
+
+  if (coro_pool_global [cls].count < CORO_STACKPOOL_GLOBAL)
+    {
+      coro_pool_push (coro_pool_global + cls, sptr, ssze);
+      pthread_mutex_unlock (&coro_pool_mutex);
+      CORO_POOL_COUNT (releases);
+      return 1;
+    }
+
+  pthread_mutex_unlock (&coro_pool_mutex);
+  CORO_POOL_COUNT (overflows);
+  return 0;
+}
+
+void
+coro_stack_pool_stats (struct coro_stack_pool_stats *stats)
+{
+  stats->hits        = __atomic_load_n (&coro_pool_stats.hits       , __ATOMIC_RELAXED);
+  stats->global_hits = __atomic_load_n (&coro_pool_stats.global_hits, __ATOMIC_RELAXED);
+  stats->misses      = __atomic_load_n (&coro_pool_stats.misses     , __ATOMIC_RELAXED);
+  stats->releases    = __atomic_load_n (&coro_pool_stats.releases   , __ATOMIC_RELAXED);
+  stats->overflows   = __atomic_load_n (&coro_pool_stats.overflows  , __ATOMIC_RELAXED);
+}
+
+void
+coro_stack_pool_trim (void)
+{
+  int cls;
+
+  coro_pool_flush (coro_pool_local);
+
+  pthread_mutex_lock (&coro_pool_mutex);
+
+  for (cls = 0; cls < CORO_POOL_CLASSES; ++cls)
+    {
+      size_t ssze = (size_t)PAGESIZE << cls;
+      void *sptr;
+
+      while ((sptr = coro_pool_pop (coro_pool_global + cls, ssze)))
+        coro_stack_unmap (sptr, ssze);
+    }
+
+  pthread_mutex_unlock (&coro_pool_mutex);
+}
+
+/* reclaim the stacks of list after the first skip ones */
+static void
+coro_pool_reclaim_list (struct coro_pool_list *list, size_t ssze, size_t keep, unsigned int skip)
+{
+  void *sptr;
+
+  for (sptr = list->head; sptr; sptr = CORO_POOL_LINK (sptr, ssze))
+    if (skip)
+      --skip;
+    else
+      coro_stack_advise (sptr, ssze, keep);
+}
+
+void
+coro_stack_pool_reclaim (size_t keep)
+{
+  int cls;
+
+  /* the list links live in the topmost word */
+  if (keep < sizeof (void *))
+    keep = sizeof (void *);
+
+  for (cls = 0; cls < CORO_POOL_CLASSES; ++cls)
+    coro_pool_reclaim_list (coro_pool_local + cls, (size_t)PAGESIZE << cls, keep, 0);
+
+  pthread_mutex_lock (&coro_pool_mutex);
+
+  for (cls = 0; cls < CORO_POOL_CLASSES; ++cls)
+    coro_pool_reclaim_list (coro_pool_global + cls, (size_t)PAGESIZE << cls, keep, 0);
+
+  pthread_mutex_unlock (&coro_pool_mutex);
+}
+
+/*
+ * The background trimmer. The lists are LIFO, so the stacks below the
+ * lowest count seen since the last look have not been used in between,
+ * and only those are reclaimed, which leaves alone the ones in steady use.
+ */
+#include <errno.h>
+#include <time.h>
+
+static pthread_t coro_trim_thread;
+static pthread_cond_t coro_trim_cond = PTHREAD_COND_INITIALIZER;
+static int coro_trim_running; /* all of these are protected by coro_pool_mutex */
+static unsigned int coro_trim_interval;
+static size_t coro_trim_keep;
+
+static void *
+coro_trim_run (void *arg)
+{
+  (void)arg;
+
+  pthread_mutex_lock (&coro_pool_mutex);
+
+  while (coro_trim_running)
+    {
+      struct timespec ts;
+      int cls;
+
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_sec  += coro_trim_interval / 1000;
+      ts.tv_nsec += coro_trim_interval % 1000 * 1000000L;
+
+      if (ts.tv_nsec >= 1000000000L)
+        {
+          ++ts.tv_sec;
+          ts.tv_nsec -= 1000000000L;
+        }
+
+      if (pthread_cond_timedwait (&coro_trim_cond, &coro_pool_mutex, &ts) != ETIMEDOUT)
+        continue;
+
+      for (cls = 0; cls < CORO_POOL_CLASSES; ++cls)
+        {
+          struct coro_pool_list *list = coro_pool_global + cls;
+
+          coro_pool_reclaim_list (list, (size_t)PAGESIZE << cls, coro_trim_keep, list->count - list->low);
+          list->low = list->count;
+        }
+    }
+
+  pthread_mutex_unlock (&coro_pool_mutex);
+
+  return 0;
+}
+
+int
+coro_stack_pool_reclaim_start (unsigned int interval, size_t keep)
+{
+  int ok = 0;
+
+  pthread_mutex_lock (&coro_pool_mutex);
+
+  if (!coro_trim_running)
+    {
+      coro_trim_interval = interval ? interval : 1;
+      coro_trim_keep     = keep < sizeof (void *) ? sizeof (void *) : keep;
+      coro_trim_running  = ok = !pthread_create (&coro_trim_thread, 0, coro_trim_run, 0);
+    }
+
+  pthread_mutex_unlock (&coro_pool_mutex);
+
+  return ok;
+}
+
+void
+coro_stack_pool_reclaim_stop (void)
+{
+  int running;
+
+  pthread_mutex_lock (&coro_pool_mutex);
+  running = coro_trim_running;
+  coro_trim_running = 0;
+  pthread_cond_signal (&coro_trim_cond);
+  pthread_mutex_unlock (&coro_pool_mutex);
+
+  if (running)
+    pthread_join (coro_trim_thread, 0);
+}
+
+#endif
+
+#if CORO_STACKWATER
+
+#if CORO_MMAP && CORO_STACKWATER == 1 && (__linux__ || __FreeBSD__ || __NetBSD__ || __OpenBSD__ || __APPLE__)
+# define CORO_WATER_MINCORE 1
+#else
+# define CORO_WATER_MINCORE 0
+#endif
+
+/* an unlikely value for a stack word */
+#define CORO_WATER_PAINT 0xdeadc0deU
+
+#if !CORO_WATER_MINCORE
+static void
+coro_water_paint (void *sptr, size_t ssze)
+{
+  unsigned int *p = (unsigned int *)sptr;
+  unsigned int *e = (unsigned int *)((char *)sptr + ssze);
+
+  while (p < e)
+    *p++ = CORO_WATER_PAINT;
+}
+#endif
+
+#endif
+
+#if CORO_STACKARENA && CORO_MMAP
+
+#include <pthread.h>
+
+#define CORO_ARENA_BITS (sizeof (unsigned long) * CHAR_BIT)
+
+#if __linux__ && !defined MADV_GUARD_INSTALL
+# define MADV_GUARD_INSTALL 102
+#endif
+
+/*
+ * The slots of an arena are laid out as guard pages followed by the stack.
+ * Guard pages are installed lazily, for all the slots of a bitmap word
+ * when the first of them is handed out. Stacks grow down, so no two
+ * guards are ever adjacent, and protecting them with mprotect would split
+ * the mapping around every single one, which is what the arena is there
+ * to avoid, so without MADV_GUARD_INSTALL the guard pages stay unused.
+ */
+struct coro_stack_arena
+{
+  char *base;            /* start of the mapping */
+  size_t slot;           /* bytes per slot, including the guard pages */
+  size_t ssze;           /* usable stack bytes per slot */
+  unsigned int count;
+  unsigned int nwords;
+  unsigned int hint;     /* the word a free slot was last found in */
+  int guarded;           /* whether the slots get guard pages */
+  pthread_mutex_t lock;  /* serialises guard setup */
+  unsigned char *ready;  /* per word, whether its guards are in place */
+  unsigned long free [1]; /* per slot, set if free */
+};
+
+static void
+coro_arena_prepare (struct coro_stack_arena *arena, unsigned int word)
+{
+  pthread_mutex_lock (&arena->lock);
+
+  if (!arena->ready [word])
+    {
+      #if CORO_GUARDPAGES && __linux__
+        unsigned int i = word * CORO_ARENA_BITS;
+        unsigned int end = i + CORO_ARENA_BITS < arena->count ? i + CORO_ARENA_BITS : arena->count;
+
+        if (arena->guarded)
+          for (; i < end; ++i)
+            madvise (arena->base + i * arena->slot, CORO_GUARDPAGES * PAGESIZE, MADV_GUARD_INSTALL);
+      #endif
+
+      __atomic_store_n (&arena->ready [word], 1, __ATOMIC_RELEASE);
+    }
+
+  pthread_mutex_unlock (&arena->lock);
+}
+
+static void *
+coro_arena_get (struct coro_stack_arena *arena)
+{
+  unsigned int n, word = __atomic_load_n (&arena->hint, __ATOMIC_RELAXED);
+
+  for (n = 0; n < arena->nwords; ++n, word = word + 1 < arena->nwords ? word + 1 : 0)
+    {
+      unsigned long bits = __atomic_load_n (&arena->free [word], __ATOMIC_RELAXED);
+
+      while (bits)
+        {
+          unsigned long bit = bits & -bits;
+
+          if (__atomic_compare_exchange_n (&arena->free [word], &bits, bits & ~bit, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+              size_t i = word * CORO_ARENA_BITS + __builtin_ctzl (bit);
+
+              if (!__atomic_load_n (&arena->ready [word], __ATOMIC_ACQUIRE))
+                coro_arena_prepare (arena, word);
+
+              __atomic_store_n (&arena->hint, word, __ATOMIC_RELAXED);
+
+              return arena->base + i * arena->slot + CORO_GUARDPAGES * PAGESIZE;
+            }
+        }
+    }
+
+  return 0;
+}
+
+static void
+coro_arena_put (struct coro_stack_arena *arena, void *sptr)
+{
+  size_t i = ((char *)sptr - arena->base) / arena->slot;
+
+  #if CORO_STACKRECLAIM
+    coro_stack_advise (sptr, arena->ssze, CORO_STACKRECLAIM);
+  #endif
+
+  __atomic_fetch_or (&arena->free [i / CORO_ARENA_BITS], 1UL << (i % CORO_ARENA_BITS), __ATOMIC_RELEASE);
+}
+
+#endif
+
+#endif
+
+int
+coro_stack_alloc (struct coro_stack *stack, unsigned int size)
+{
+  if (!size)
+    size = 256 * 1024;
+
+  stack->sptr = 0;
+  stack->ssze = ((size_t)size * sizeof (void *) + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+
+#if CORO_STACKARENA
+  stack->arena = 0;
+#endif
+
+#if CORO_FIBER
+
+  stack->sptr = (void *)stack;
+  CORO_STATS_COUNT (stack_allocs);
+  return 1;
+
+#else
+
+  void *base = 0;
+
+  #if CORO_STACKPOOL
+    int cls = coro_pool_class (stack->ssze);
+
+    if (cls < CORO_POOL_CLASSES)
+      {
+        stack->ssze = (size_t)PAGESIZE << cls;
+        base = coro_pool_get (cls, stack->ssze);
+      }
+
+    if (!base)
+  #endif
+    base = coro_stack_map (stack->ssze);
+
+  if (!base)
+    return 0;
+
+  #if CORO_STACKWATER && !CORO_WATER_MINCORE
+    coro_water_paint (base, stack->ssze);
+  #endif
+
+  #if CORO_USE_VALGRIND
+    stack->valgrind_id = VALGRIND_STACK_REGISTER ((char *)base, ((char *)base) + stack->ssze);
+  #endif
+
+  stack->sptr = base;
+  CORO_STATS_COUNT (stack_allocs);
+  CORO_PROBE2 (stack_alloc, base, stack->ssze);
+  return 1;
+
+#endif
+}
+
+void
+coro_stack_free (struct coro_stack *stack)
+{
+  /* sptr 0 means there is nothing to free, so nothing to count either */
+  if (stack->sptr)
+    {
+      CORO_STATS_COUNT (stack_frees);
+      CORO_PROBE2 (stack_free, stack->sptr, stack->ssze);
+    }
+
+#if CORO_FIBER
+  /* nop */
+#else
+  #if CORO_USE_VALGRIND
+    VALGRIND_STACK_DEREGISTER (stack->valgrind_id);
+  #endif
+
+  #if CORO_STACKARENA && CORO_MMAP
+    if (stack->arena)
+      {
+        if (stack->sptr)
+          coro_arena_put (stack->arena, stack->sptr);
+
+        return;
+      }
+  #endif
+
+  #if CORO_STACKPOOL
+    if (stack->sptr)
+      {
+        int cls = coro_pool_class (stack->ssze);
+
+        /* only stacks of exactly a class size can have come from coro_stack_alloc */
+        if (cls < CORO_POOL_CLASSES && (size_t)PAGESIZE << cls == stack->ssze
+            && coro_pool_put (cls, stack->sptr, stack->ssze))
+          return;
+      }
+  #endif
+
+  coro_stack_unmap (stack->sptr, stack->ssze);
+#endif
+}
+
+size_t
+coro_stack_reclaim (struct coro_stack *stack, coro_context *ctx, size_t keep)
+{
+#if CORO_FIBER
+  (void)ctx;
+  return 0;
+#else
+  if (ctx)
+    {
+      #if CORO_ASM || CORO_UCONTEXT_FAST
+        /* everything from the saved stack pointer up is live */
+        char *sp = (char *)ctx->sp;
+
+        if (sp < (char *)stack->sptr || sp > (char *)stack->sptr + stack->ssze)
+          return 0;
+
+        keep += (char *)stack->sptr + stack->ssze - sp;
+      #else
+        /* no way to tell how much of the stack is in use */
+        return 0;
+      #endif
+    }
+
+  return coro_stack_advise (stack->sptr, stack->ssze, keep);
+#endif
+}
+
+#if CORO_STACKARENA
+
+struct coro_stack_arena *
+coro_stack_arena_new (unsigned int size, unsigned int count)
+{
+#if CORO_FIBER || !CORO_MMAP
+  (void)size; (void)count;
+  return 0;
+#else
+  struct coro_stack_arena *arena;
+  unsigned int i, nwords = (count + CORO_ARENA_BITS - 1) / CORO_ARENA_BITS;
+  void *base;
+
+  if (!size)
+    size = 256 * 1024;
+
+  if (!count)
+    return 0;
+
+  arena = (struct coro_stack_arena *)malloc (sizeof (struct coro_stack_arena)
+                                             + (nwords - 1) * sizeof (unsigned long));
+
+  if (!arena)
+    return 0;
+
+  arena->ssze = ((size_t)size * sizeof (void *) + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+  arena->slot = arena->ssze + CORO_GUARDPAGES * PAGESIZE;
+
+  /* slot * count must not wrap, which it can on 32 bit */
+  if (count > (size_t)-1 / arena->slot)
+    {
+      free (arena);
+      errno = ENOMEM;
+      return 0;
+    }
+
+  arena->ready = (unsigned char *)calloc (nwords, 1);
+
+  if (!arena->ready)
+    {
+      free (arena);
+      return 0;
+    }
+
+  #ifndef MAP_NORESERVE
+  # define MAP_NORESERVE 0
+  #endif
+
+  /* see coro_stack_map */
+  base = mmap (0, arena->slot * count, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (base == (void *)-1)
+    base = mmap (0, arena->slot * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (base == (void *)-1)
+    {
+      free (arena->ready);
+      free (arena);
+      return 0;
+    }
+
+  arena->base          = (char *)base;
+  arena->count         = count;
+  arena->nwords        = nwords;
+  arena->hint          = 0;
+  arena->guarded       = 0;
+  pthread_mutex_init (&arena->lock, 0);
+
+  #if CORO_GUARDPAGES && __linux__
+    /* Linux 6.13 and newer can guard pages without splitting the mapping, try on the first slot */
+    arena->guarded = !madvise (base, CORO_GUARDPAGES * PAGESIZE, MADV_GUARD_INSTALL);
+  #endif
+
+  for (i = 0; i < nwords; ++i)
+    arena->free [i] = ~0UL;
+
+  if (count % CORO_ARENA_BITS)
+    arena->free [nwords - 1] = (1UL << count % CORO_ARENA_BITS) - 1;
+
+  return arena;
+#endif
+}
+
+int
+coro_stack_arena_guarded (struct coro_stack_arena *arena)
+{
+#if !CORO_FIBER && CORO_MMAP
+  return arena->guarded;
+#else
+  (void)arena;
+  return 0;
+#endif
+}
+
+void
+coro_stack_arena_free (struct coro_stack_arena *arena)
+{
+#if !CORO_FIBER && CORO_MMAP
+  munmap (arena->base, arena->slot * arena->count);
+  pthread_mutex_destroy (&arena->lock);
+  free (arena->ready);
+  free (arena);
+#else
+  (void)arena;
+#endif
+}
+
+int
+coro_stack_arena_alloc (struct coro_stack_arena *arena, struct coro_stack *stack)
+{
+  stack->sptr  = 0;
+  stack->arena = 0;
+
+#if CORO_FIBER || !CORO_MMAP
+  (void)arena;
+  return 0;
+#else
+  stack->ssze = arena->ssze;
+  stack->sptr = coro_arena_get (arena);
+
+  if (!stack->sptr)
+    return 0;
+
+  stack->arena = arena;
+  CORO_STATS_COUNT (stack_allocs);
+  CORO_PROBE2 (stack_alloc, stack->sptr, stack->ssze);
+
+  #if CORO_STACKWATER && !CORO_WATER_MINCORE
+    coro_water_paint (stack->sptr, stack->ssze);
+  #endif
+
+  #if CORO_USE_VALGRIND
+    stack->valgrind_id = VALGRIND_STACK_REGISTER ((char *)stack->sptr, ((char *)stack->sptr) + stack->ssze);
+  #endif
+
+  return 1;
+#endif
+}
+
+#endif
+
+#if CORO_STACKWATER
+
+size_t
+coro_stack_watermark (struct coro_stack *stack)
+{
+#if CORO_FIBER
+  return 0;
+#else
+  char *base = (char *)stack->sptr;
+  char *top = base + stack->ssze;
+
+  if (!base)
+    return 0;
+
+  #if CORO_WATER_MINCORE
+    {
+      /* the stack grows down, so the lowest resident page is the deepest one used */
+      unsigned char vec [256];
+      size_t pagesize = PAGESIZE;
+      size_t pages = stack->ssze / pagesize;
+      size_t done, i, n;
+
+      for (done = 0; done < pages; done += n)
+        {
+          n = pages - done < sizeof (vec) ? pages - done : sizeof (vec);
+
+          /* if we cannot tell, assume the worst */
+          if (mincore (base + done * pagesize, n * pagesize, (void *)vec))
+            return stack->ssze;
+
+          for (i = 0; i < n; ++i)
+            if (vec [i] & 1)
+              return top - (base + (done + i) * pagesize);
+        }
+
+      return 0;
+    }
+  #else
+    {
+      unsigned int *p = (unsigned int *)base;
+
+      while ((char *)p < top && *p == CORO_WATER_PAINT)
+        ++p;
+
+      return top - (char *)p;
+    }
+  #endif
+#endif
+}
+
+#endif
+
+#endif
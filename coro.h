@@ -119,12 +119,25 @@ extern "C" {
  *    This flavour uses SUSv2's get/set/swap/makecontext functions that
  *    unfortunately only some unices support, and is quite slow.
  *
+ *    If CORO_UCONTEXT_FAST is also defined to 1, coroutines are still
+ *    created with getcontext/makecontext, but coro_transfer uses the
+ *    CORO_ASM switcher instead of swapcontext, so it does not save or
+ *    restore the signal mask, which makes it a lot faster. Use
+ *    coro_save_sigmask to get the old behaviour for individual contexts.
+ *    This is only supported on x86/amd64/aarch64/riscv64 and ignored
+ *    elsewhere.
+ *
  * -DCORO_SJLJ
  *
  *    This flavour uses SUSv2's setjmp/longjmp and sigaltstack functions to
  *    do it's job. Coroutine creation is much slower than UCONTEXT, but
  *    context switching is a bit cheaper. It should work on almost all unices.
  *
+ *    On amd64, x86, aarch64 and riscv64, new coroutines are instead set up
+ *    by briefly switching the stack pointer to the new stack, which needs
+ *    no signals or system calls and is thread-safe. Define CORO_SJLJ_PIVOT
+ *    to 0 to use the sigaltstack trampoline anyway.
+ *
  * -DCORO_LINUX
  *
  *    CORO_SJLJ variant.
@@ -153,8 +166,8 @@ extern "C" {
  * -DCORO_ASM
  *
  *    Hand coded assembly, known to work only on a few architectures/ABI:
- *    GCC + arm7/x86/IA32/amd64/x86_64 + GNU/Linux and a few BSDs. Fastest
- *    choice, if it works.
+ *    GCC + arm7/aarch64/riscv64/x86/IA32/amd64/x86_64 + GNU/Linux and a few
+ *    BSDs. Fastest choice, if it works.
  *
  * -DCORO_PTHREAD
  *
@@ -162,6 +175,13 @@ extern "C" {
  *    This is likely the slowest backend, and it also does not support fork(),
  *    so avoid it at all costs.
  *
+ *    On Linux, each context gets its own futex word that its thread waits
+ *    on, so a transfer is a single wake/wait pair and there is no lock
+ *    shared by all coroutines (define CORO_PTHREAD_FUTEX to 0 to use the
+ *    portable mutex and condition variable instead). Defining
+ *    CORO_PTHREAD_SPIN to n makes a thread spin n times before it goes to
+ *    sleep, which helps when the coroutines' threads run on different cpus.
+ *
  * If you define neither of these symbols, coro.h will try to autodetect
  * the best/safest model. To help with the autodetection, you should check
  * (e.g. using autoconf) and define the following symbols: HAVE_UCONTEXT_H
@@ -205,7 +225,8 @@ typedef struct coro_context coro_context;
  * as an initial source for coro_transfer.
  *
  * This function is not reentrant, but putting a mutex around it
- * will work.
+ * will work. With CORO_ASM, it only lays out the initial frame on the
+ * new stack, without switching to it, and is thread-safe and reentrant.
  */
 void coro_create (coro_context *ctx, /* an uninitialised coro_context */
                   coro_func coro,    /* the coroutine code to be executed */
@@ -236,6 +257,108 @@ void coro_transfer (coro_context *prev, coro_context *next);
 void coro_destroy (coro_context *ctx);
 #endif
 
+/*
+ * Like coro_transfer, but also hand value over to next: the
+ * coro_transfer_value call that next is suspended in returns it, or, if
+ * next was created by coro_create_value and has not run yet, its
+ * coroutine function gets it as argument. With CORO_ASM, the value stays
+ * in a register all the way; the other backends store it in next.
+ *
+ * The return value is unspecified when the context is resumed by a plain
+ * coro_transfer, and the value is lost when next is suspended in one.
+ */
+#if 0
+void *coro_transfer_value (coro_context *prev, coro_context *next, void *value);
+#endif
+
+/*
+ * Like coro_create, but instead of a fixed argument, the coroutine
+ * function is passed the value of the coro_transfer_value that first
+ * switches to it.
+ */
+void coro_create_value (coro_context *ctx, coro_func coro, void *sptr, size_t ssze);
+
+/*****************************************************************************/
+/* moving coroutines between threads                                         */
+/*****************************************************************************/
+/*
+ * With CORO_ASM (and, in practice, CORO_UCONTEXT and CORO_SJLJ on
+ * glibc), a context suspended on one thread can be resumed by a
+ * coro_transfer on another, e.g. to balance load. CORO_PTHREAD handles
+ * this differently (see the 2018 changelog entry), CORO_FIBER not at all.
+ * The contract is:
+ *
+ * - A context is only ever resumed once it has been suspended, and the
+ *   thread that resumes it must see everything the suspending thread did
+ *   before it suspended it, i.e. hand it over through a mutex, or a
+ *   release store and an acquire load. coro_transfer itself contains no
+ *   memory barriers.
+ *
+ * - Compilers assume that a function runs on the same thread from start
+ *   to finish, so they compute the address of a thread-local variable
+ *   (errno is one) once and keep using it after calls, including a
+ *   coro_transfer that returned on another thread. Every access to a
+ *   thread-local variable after such a coro_transfer must therefore go
+ *   through a function that is called anew, and that the compiler can
+ *   neither inline nor assume to return the same value as last time: use
+ *   coro_errno instead of errno, and CORO_TLS_ACCESSOR for your own
+ *   variables. Accesses in functions that do not switch themselves, and
+ *   that are called after the switch, are fine.
+ *
+ * - What belongs to a thread stays with the thread: its errno, signal
+ *   mask (CORO_ASM does not switch it) and floating point environment,
+ *   its thread id, and the pthread mutexes it holds, which must be
+ *   unlocked on the thread that locked them.
+ *
+ * The library's own functions keep to this, coro_resume and coro_yield
+ * included, and stacks can be freed on a different thread than the one
+ * that allocated them.
+ */
+
+/*
+ * The calling thread's errno, looked up anew on every use.
+ */
+int *coro_errno_location (void);
+#define coro_errno (*coro_errno_location ())
+
+/* keep a function out of line (without warning if unused), and a compiler-only memory barrier */
+#if __GNUC__
+# define CORO_NOINLINE __attribute__ ((__noinline__, __unused__))
+# define CORO_COMPILER_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+#elif _MSC_VER
+# include <intrin.h>
+# define CORO_NOINLINE __declspec (noinline)
+# define CORO_COMPILER_BARRIER() _ReadWriteBarrier ()
+#else
+# define CORO_NOINLINE
+# define CORO_COMPILER_BARRIER() ((void)0)
+#endif
+
+/*
+ * Define a function name returning the address of the thread-local
+ * variable var of the given type, looked up anew on every call: the
+ * compiler barrier stops the compiler from considering it constant.
+ */
+#define CORO_TLS_ACCESSOR(type,name,var)               \
+  static CORO_NOINLINE type *                          \
+  name (void)                                          \
+  {                                                    \
+    CORO_COMPILER_BARRIER ();                          \
+    return &(var);                                     \
+  }
+
+/*****************************************************************************/
+/* optional asymmetric coroutines                                            */
+/*****************************************************************************/
+/*
+ * An asymmetric layer on top of coro_transfer_value, with coro_resume and
+ * coro_yield: a coroutine always yields back to whoever resumed it last,
+ * and returning from it ends it, instead of calling abort.
+ * It is available unless CORO_ASYM is defined to 0, and needs compiler
+ * support for thread-local variables (__thread, __declspec (thread) or
+ * C11's _Thread_local), without which it is off by default.
+ */
+
 /*****************************************************************************/
 /* optional stack management                                                 */
 /*****************************************************************************/
@@ -257,11 +380,86 @@ void coro_destroy (coro_context *ctx);
  *    stack overflow. If n is 0, then the feature will be disabled. If it isn't
  *    defined, then libcoro will choose a suitable default. If guardpages are not
  *    supported on the platform, then the feature will be silently disabled.
+ *
+ * -DCORO_STACKPOOL=n
+ *
+ *    If n is non-zero, coro_stack_free does not unmap the stack but keeps it
+ *    in a per-thread free list (at most n stacks per size class), from which
+ *    coro_stack_alloc hands it out again, already mapped and guarded. Stacks
+ *    that do not fit into the per-thread list go to a global overflow list,
+ *    limited to CORO_STACKPOOL_GLOBAL stacks per size class (default 4 * n).
+ *    Stack sizes are rounded up to a power of two pages. This requires
+ *    pthreads and compiler support for __thread.
+ *
+ * -DCORO_STACKWATER=n
+ *
+ *    If n is non-zero, coro_stack_watermark tells how much of a stack has
+ *    been used. With n = 1, it asks mincore(2) which pages of the stack are
+ *    resident, which costs nothing until called, but only has page
+ *    granularity, and counts everything the stack was used for since it was
+ *    mapped (including before it was pooled and handed out again). With
+ *    n = 2, or where mincore is not available, coro_stack_alloc paints every
+ *    stack with a pattern instead, which gives a result exact to the word,
+ *    but makes the whole stack resident - use it for sizing stacks, not in
+ *    production.
+ *
+ * -DCORO_STACKRECLAIM=n
+ *
+ *    If n is non-zero (and CORO_STACKPOOL or CORO_STACKARENA is enabled),
+ *    stacks put into the pool or given back to their arena by
+ *    coro_stack_free keep only their topmost n bytes (rounded up to whole
+ *    pages) resident, the rest is given back to the kernel (see
+ *    coro_stack_reclaim), so a stack that once ran deep recursion does not
+ *    carry that memory around forever.
+ *
+ * -DCORO_STACKRECLAIM_LAZY
+ *
+ *    If defined and non-zero, stack memory is released with MADV_FREE
+ *    where available, which is cheaper, but lets the kernel take the pages
+ *    only when it runs short of memory (so they still count towards the
+ *    RSS until then). Otherwise, MADV_DONTNEED is used.
+ *
+ * -DCORO_STACKARENA
+ *
+ *    If defined and non-zero, coro_stack_arena_new and coro_stack_arena_alloc
+ *    are available, which carve fixed-size stacks out of one big mapping
+ *    instead of mapping every stack on its own. This keeps the number of
+ *    kernel memory mappings low when there are many stacks (Linux limits
+ *    them to vm.max_map_count, 65530 by default). Guard pages are only
+ *    installed with MADV_GUARD_INSTALL (Linux 6.13 and newer), which does
+ *    not split the mapping. Elsewhere, and on older kernels, the stacks of
+ *    an arena have no guard pages (mprotect would split the mapping for
+ *    every slot), see coro_stack_arena_guarded.
+ *    This requires pthreads.
  */
 #ifndef CORO_STACKALLOC
 # define CORO_STACKALLOC 1
 #endif
 
+#ifndef CORO_ASYM
+# if __GNUC__ || _MSC_VER || __STDC_VERSION__ >= 201112L
+#  define CORO_ASYM 1
+# else
+#  define CORO_ASYM 0 /* no thread-local variables */
+# endif
+#endif
+
+#ifndef CORO_STACKPOOL
+# define CORO_STACKPOOL 0
+#endif
+
+#ifndef CORO_STACKWATER
+# define CORO_STACKWATER 0
+#endif
+
+#ifndef CORO_STACKRECLAIM
+# define CORO_STACKRECLAIM 0
+#endif
+
+#ifndef CORO_STACKARENA
+# define CORO_STACKARENA 0
+#endif
+
 #if CORO_STACKALLOC
 
 /*
@@ -279,6 +477,9 @@ struct coro_stack
 #if CORO_USE_VALGRIND
   int valgrind_id;
 #endif
+#if CORO_STACKARENA
+  struct coro_stack_arena *arena;
+#endif
 };
 
 /*
@@ -300,6 +501,231 @@ int coro_stack_alloc (struct coro_stack *stack, unsigned int size);
  */
 void coro_stack_free (struct coro_stack *stack);
 
+/*
+ * Give the unused memory of the stack back to the kernel, while keeping
+ * it mapped. The memory reads as zero when touched again. ctx is the
+ * suspended coroutine on the stack (for coro_asym, its ctx member), which
+ * must not be running. Everything from its saved stack pointer up stays,
+ * plus keep bytes below that as a margin, rounded up to whole pages. If
+ * ctx is 0, nothing may be using the stack, and only its topmost keep
+ * bytes stay. Returns the number of bytes released, which is 0 where this
+ * is not supported, and also for a ctx with backends other than asm and
+ * ucontext with CORO_UCONTEXT_FAST, where the stack pointer of a
+ * suspended coroutine is not known.
+ *
+ * With CORO_STACKWATER=2, coro_stack_watermark reports the whole stack as
+ * used afterwards.
+ */
+size_t coro_stack_reclaim (struct coro_stack *stack, coro_context *ctx, size_t keep);
+
+#if CORO_STACKARENA
+
+struct coro_stack_arena;
+
+/*
+ * Reserve address space for count stacks of the given size (as for
+ * coro_stack_alloc, but always rounded to whole pages only), each below
+ * its own guard pages (but see coro_stack_arena_guarded), in a single
+ * mapping. Memory is only committed as the stacks are used. Returns 0
+ * on failure.
+ */
+struct coro_stack_arena *coro_stack_arena_new (unsigned int size, unsigned int count);
+
+/*
+ * Return whether the stacks of the arena are protected by guard pages,
+ * which needs MADV_GUARD_INSTALL. Without, a stack overflow silently
+ * runs into the neighbouring slot, so size them generously or use
+ * coro_stack_alloc instead.
+ */
+int coro_stack_arena_guarded (struct coro_stack_arena *arena);
+
+/*
+ * Unmap the arena and all stacks in it, which must not be in use anymore.
+ */
+void coro_stack_arena_free (struct coro_stack_arena *arena);
+
+/*
+ * Like coro_stack_alloc, but take a free slot of the arena, which fails
+ * when all slots are in use. The stack is given back to the arena by
+ * coro_stack_free. Both can be called from any thread.
+ */
+int coro_stack_arena_alloc (struct coro_stack_arena *arena, struct coro_stack *stack);
+
+#endif
+
+#if CORO_STACKWATER
+
+/*
+ * Return the number of bytes of the stack, counted from its top, that
+ * have been used so far, i.e. the distance from the top to the deepest
+ * byte any coroutine running on it touched. Returns 0 if this cannot be
+ * determined (e.g. with CORO_FIBER).
+ */
+size_t coro_stack_watermark (struct coro_stack *stack);
+
+#endif
+
+#if CORO_STACKPOOL
+
+/*
+ * Counters of the stack pool, summed over all threads. They are updated
+ * without synchronisation beyond atomicity, so a snapshot is only
+ * approximately consistent.
+ */
+struct coro_stack_pool_stats
+{
+  unsigned long hits;        /* allocations served from the per-thread list */
+  unsigned long global_hits; /* allocations served from the global list */
+  unsigned long misses;      /* allocations that had to map a new stack */
+  unsigned long releases;    /* stacks returned to one of the lists */
+  unsigned long overflows;   /* stacks unmapped because the pool was full */
+};
+
+/*
+ * Store a snapshot of the pool counters in *stats.
+ */
+void coro_stack_pool_stats (struct coro_stack_pool_stats *stats);
+
+/*
+ * Unmap all stacks cached by the calling thread and in the global list.
+ * Stacks cached by other threads are released when those threads exit.
+ */
+void coro_stack_pool_trim (void);
+
+/*
+ * Like coro_stack_reclaim, for all stacks cached by the calling thread and
+ * in the global list, which stay cached. Meant to be called periodically,
+ * e.g. from an idle handler or timer, to drop the memory of pooled stacks
+ * after a load spike.
+ */
+void coro_stack_pool_reclaim (size_t keep);
+
+/*
+ * Start a background thread that, every interval milliseconds, does the
+ * same for the stacks in the global list that were not needed since it
+ * last looked, so stacks in steady use are left alone. Stacks cached by a
+ * thread are not touched, see CORO_STACKRECLAIM for those. Returns false
+ * if it is already running or the thread could not be created.
+ */
+int coro_stack_pool_reclaim_start (unsigned int interval, size_t keep);
+
+/*
+ * Stop the thread started by coro_stack_pool_reclaim_start, if any.
+ */
+void coro_stack_pool_reclaim_stop (void);
+
+#endif
+
+#endif
+
+/*****************************************************************************/
+/* optional statistics                                                       */
+/*****************************************************************************/
+/*
+ * -DCORO_STATS
+ *
+ *    If defined and non-zero, every thread counts its switches, coroutine
+ *    creations and stack allocations, and where sys/sdt.h is available,
+ *    the same events are USDT probes (provider libcoro, probes transfer,
+ *    create, stack_alloc and stack_free), which tools like bpftrace and
+ *    perf can attach to. Unattached probes are a nop instruction each, but
+ *    the counting costs an extra function call per switch, which is why
+ *    this is off by default. This requires pthreads and compiler support
+ *    for __thread.
+ */
+#ifndef CORO_STATS
+# define CORO_STATS 0
+#endif
+
+#if CORO_STATS
+
+struct coro_stats
+{
+  unsigned long transfers;    /* switches, including coro_transfer_value, coro_resume and coro_yield */
+  unsigned long creates;      /* coro_create and coro_create_value calls, not counting empty contexts */
+  unsigned long stack_allocs; /* stacks handed out by coro_stack_alloc and coro_stack_arena_alloc */
+  unsigned long stack_frees;  /* coro_stack_free calls */
+};
+
+/*
+ * Store the counters summed over all threads, including those that have
+ * exited, in *stats. The counters of running threads are read while they
+ * keep counting, so the snapshot is only approximately consistent, but
+ * each counter only goes up.
+ */
+void coro_stats (struct coro_stats *stats);
+
+/*
+ * Store the counters of the calling thread in *stats.
+ */
+void coro_stats_thread (struct coro_stats *stats);
+
+/* counts and probes a switch, used by the coro_transfer implementations */
+void coro_stats_switch (coro_context *prev, coro_context *next);
+
+#endif
+
+/*****************************************************************************/
+/*
+ * -DCORO_PROFILE
+ *
+ *    If defined and non-zero, every switch remembers the context switched
+ *    to as the one running on the thread, and coro_profile_start samples
+ *    it from a SIGPROF handler, so cpu profiles can be split by coroutine
+ *    and by entry function. Like CORO_STATS, this costs an extra function
+ *    call per switch. Not available with CORO_PTHREAD, and requires
+ *    compiler support for __thread.
+ *
+ *    Independently of this, backtraces (in debuggers, profilers such as
+ *    perf, or _Unwind_Backtrace) end at the first frame of a coroutine,
+ *    which is coro_startup with CORO_ASM, when the compiler emits unwind
+ *    information.
+ */
+#ifndef CORO_PROFILE
+# define CORO_PROFILE 0
+#endif
+
+#if CORO_PROFILE
+
+struct coro_profile_sample
+{
+  coro_context *ctx; /* the running context, 0 if the thread never switched */
+  coro_func func;    /* its entry function, 0 for contexts created empty */
+  void *pc;          /* the interrupted instruction, 0 where unknown */
+};
+
+/*
+ * Start sampling the running context of whichever thread receives
+ * SIGPROF, hz times per second of cpu time used by the process, into
+ * samples, until count samples are taken. Replaces any SIGPROF handler
+ * and ITIMER_PROF timer until coro_profile_stop. Returns 0 on success, or
+ * -1 and sets errno.
+ */
+int coro_profile_start (unsigned int hz, struct coro_profile_sample *samples, size_t count);
+
+/*
+ * Stop sampling, restore the previous SIGPROF handler and return the
+ * number of samples stored.
+ */
+size_t coro_profile_stop (void);
+
+/* remembers the running context, used by the coro_transfer implementations */
+void coro_profile_switch (coro_context *prev, coro_context *next);
+
+/* for coro_create to record the entry function in */
+# define CORO_PROFILE_ENTRY coro_func profile_entry;
+
+#else
+# define CORO_PROFILE_ENTRY
+#endif
+
+/* called before every switch */
+#if CORO_STATS
+# define CORO_STATS_SWITCH(prev,next) coro_stats_switch ((prev), (next))
+#elif CORO_PROFILE
+# define CORO_STATS_SWITCH(prev,next) coro_profile_switch ((prev), (next))
+#else
+# define CORO_STATS_SWITCH(prev,next) ((void)0)
 #endif
 
 /*
@@ -316,7 +742,7 @@ void coro_stack_free (struct coro_stack *stack);
 #  define CORO_ASM 1
 # elif defined WINDOWS || defined _WIN32
 #  define CORO_LOSER 1 /* you don't win with windoze */
-# elif __linux && (__i386__ || (__x86_64__ && !__ILP32__)) /*|| (__arm__ && __ARM_ARCH == 7)), not working */
+# elif __linux && (__i386__ || (__x86_64__ && !__ILP32__) || (__aarch64__ && !__ILP32__) || (__riscv && __riscv_xlen == 64)) /*|| (__arm__ && __ARM_ARCH == 7)), not working */
 #  define CORO_ASM 1
 # elif defined HAVE_UCONTEXT_H
 #  define CORO_UCONTEXT 1
@@ -333,13 +759,40 @@ error unknown or unsupported architecture
 
 # include <ucontext.h>
 
+# if CORO_UCONTEXT_FAST && !(__i386__ || (__x86_64__ && !__ILP32__) || __aarch64__ || (__riscv && __riscv_xlen == 64))
+#  undef CORO_UCONTEXT_FAST
+# endif
+
 struct coro_context
 {
+# if CORO_UCONTEXT_FAST
+  void **sp; /* must be at offset 0 */
+  int sigmask;
+# endif
   ucontext_t uc;
+  /* for coro_transfer_value */
+  void *value;
+  coro_func value_coro;
+  CORO_PROFILE_ENTRY
 };
 
-# define coro_transfer(p,n) swapcontext (&((p)->uc), &((n)->uc))
-# define coro_destroy(ctx) (void *)(ctx)
+# if CORO_UCONTEXT_FAST
+
+void coro_transfer (coro_context *prev, coro_context *next);
+
+/*
+ * If save is true, the signal mask is saved whenever ctx is switched away
+ * from, and restored when it is switched back to. This costs two system
+ * calls per switch. It has to be called after coro_create, which disables
+ * it.
+ */
+#  define coro_save_sigmask(ctx,save) ((ctx)->sigmask = !!(save))
+
+# else
+#  define coro_transfer(p,n) (CORO_STATS_SWITCH ((p), (n)), swapcontext (&((p)->uc), &((n)->uc)))
+# endif
+
+# define coro_destroy(ctx) ((void)(ctx))
 
 #elif CORO_SJLJ || CORO_LOSER || CORO_LINUX || CORO_IRIX
 
@@ -382,16 +835,25 @@ struct coro_context
 struct coro_context
 {
   coro_jmp_buf env;
+  /* for coro_transfer_value */
+  void *value;
+  coro_func value_coro;
+  CORO_PROFILE_ENTRY
 };
 
-# define coro_transfer(p,n) do { if (!coro_setjmp ((p)->env)) coro_longjmp ((n)->env); } while (0)
-# define coro_destroy(ctx) (void *)(ctx)
+# define coro_transfer(p,n) do { CORO_STATS_SWITCH ((p), (n)); if (!coro_setjmp ((p)->env)) coro_longjmp ((n)->env); } while (0)
+# define coro_destroy(ctx) ((void)(ctx))
 
 #elif CORO_ASM
 
 struct coro_context
 {
   void **sp; /* must be at offset 0 */
+# if CORO_SHSTK
+  void *ss; /* the shadow stack, when the kernel enforces them */
+  size_t ss_size;
+# endif
+  CORO_PROFILE_ENTRY
 };
 
 #if __i386__ || __x86_64__
@@ -401,20 +863,118 @@ void __attribute__ ((__noinline__))
 #endif
 coro_transfer (coro_context *prev, coro_context *next);
 
-# define coro_destroy(ctx) (void *)(ctx)
+/* the same switcher, the value is in the third argument register */
+#if __i386__ || __x86_64__
+void * __attribute__ ((__noinline__, __regparm__(3)))
+#else
+void * __attribute__ ((__noinline__))
+#endif
+coro_transfer_value (coro_context *prev, coro_context *next, void *value);
+
+# if CORO_INLINE_SWITCH && __x86_64__ && !__ILP32__ && !(_WIN32 || __CYGWIN__) && !CORO_SHSTK
+
+/*
+ * The switcher inlined into the caller. It leaves the same frame behind
+ * as coro_transfer (a return address, rbp, and room for the other
+ * callee-saved registers), so each can resume contexts suspended by the
+ * other, but it only saves rbp, which might be the frame pointer: all
+ * other registers are declared clobbered, so the compiler keeps only the
+ * values that are live across the switch, in whatever way is cheapest
+ * at that point. The caller might be using the red zone, so that is
+ * skipped first. It does not switch shadow stacks, so it is not used
+ * with CORO_SHSTK.
+ *
+ * There are no CFI notes for the stack pointer moves, so a debugger or
+ * unwinder stopped inside the asm statement itself gets a wrong frame;
+ * anywhere else in the caller it is fine.
+ */
+static inline void *
+coro_transfer_value_inline (coro_context *prev, coro_context *next, void *value)
+{
+  __asm__ __volatile__ (
+    "leaq -128(%%rsp), %%rsp\n\t"
+    "leaq 1f(%%rip), %%rcx\n\t"
+    "pushq %%rcx\n\t"
+    "pushq %%rbp\n\t"
+    "subq $40, %%rsp\n\t"
+    "movq %%rsp, (%%rdi)\n\t"
+    "movq (%%rsi), %%rsp\n\t"
+    "popq %%r15\n\t"
+    "popq %%r14\n\t"
+    "popq %%r13\n\t"
+    "popq %%r12\n\t"
+    "popq %%rbx\n\t"
+    "popq %%rbp\n\t"
+    "popq %%rcx\n\t"
+    "jmpq *%%rcx\n"
+    "1:\n\t"
+    "leaq 128(%%rsp), %%rsp\n"
+    : "+D" (prev), "+S" (next), "+a" (value)
+    :
+    : "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+      "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+      "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+#  if __AVX512F__
+      "xmm16", "xmm17", "xmm18", "xmm19", "xmm20", "xmm21", "xmm22", "xmm23",
+      "xmm24", "xmm25", "xmm26", "xmm27", "xmm28", "xmm29", "xmm30", "xmm31",
+      "k1", "k2", "k3", "k4", "k5", "k6", "k7",
+#  endif
+      "st", "st(1)", "st(2)", "st(3)", "st(4)", "st(5)", "st(6)", "st(7)",
+      "mm0", "mm1", "mm2", "mm3", "mm4", "mm5", "mm6", "mm7",
+      "cc", "memory"
+  );
+
+  return value;
+}
+
+#  define coro_transfer(p,n) ((void)(CORO_STATS_SWITCH ((p), (n)), coro_transfer_value_inline ((p), (n), 0)))
+#  define coro_transfer_value(p,n,v) (CORO_STATS_SWITCH ((p), (n)), coro_transfer_value_inline ((p), (n), (v)))
+
+/* the switcher has no room for counting, so do it on the way in */
+# elif CORO_STATS || CORO_PROFILE
+#  define coro_transfer(p,n) (CORO_STATS_SWITCH ((p), (n)), coro_transfer ((p), (n)))
+#  define coro_transfer_value(p,n,v) (CORO_STATS_SWITCH ((p), (n)), coro_transfer_value ((p), (n), (v)))
+# endif
+
+# if CORO_SHSTK
+void coro_destroy (coro_context *ctx);
+# else
+#  define coro_destroy(ctx) ((void)(ctx))
+# endif
 
 #elif CORO_PTHREAD
 
 # include <pthread.h>
 
+# if !defined CORO_PTHREAD_FUTEX && __linux__
+#  define CORO_PTHREAD_FUTEX 1
+# endif
+
+# if CORO_PTHREAD_FUTEX
+
+struct coro_context
+{
+  int flags;
+  /* for coro_transfer_value */
+  void *value;
+  coro_func value_coro;
+};
+
+# else
+
 extern pthread_mutex_t coro_mutex;
 
 struct coro_context
 {
   int flags;
   pthread_cond_t cv;
+  /* for coro_transfer_value */
+  void *value;
+  coro_func value_coro;
 };
 
+# endif
+
 void coro_transfer (coro_context *prev, coro_context *next);
 void coro_destroy (coro_context *ctx);
 
@@ -426,6 +986,10 @@ struct coro_context
   /* only used for initialisation */
   coro_func coro;
   void *arg;
+  /* for coro_transfer_value */
+  void *value;
+  coro_func value_coro;
+  CORO_PROFILE_ENTRY
 };
 
 void coro_transfer (coro_context *prev, coro_context *next);
@@ -433,6 +997,124 @@ void coro_destroy (coro_context *ctx);
 
 #endif
 
+#if !CORO_ASM
+void *coro_transfer_value (coro_context *prev, coro_context *next, void *value);
+#endif
+
+#if CORO_ASYM
+
+/*
+ * The function run by an asymmetric coroutine. It gets the value of the
+ * first coro_resume, and whatever it returns is returned by the
+ * coro_resume that it returns to.
+ */
+typedef void *(*coro_asym_func)(void *value);
+
+enum
+{
+  CORO_ASYM_NEW,       /* created, but never resumed */
+  CORO_ASYM_SUSPENDED, /* in coro_yield */
+  CORO_ASYM_RUNNING,   /* resumed, and neither yielded nor returned yet */
+  CORO_ASYM_DONE       /* its function has returned */
+};
+
+/*
+ * The only allowed operation on these struct members is reading
+ * "status" (one of the CORO_ASYM constants).
+ */
+typedef struct coro_asym coro_asym;
+
+struct coro_shared_stack;
+
+struct coro_asym
+{
+  coro_context ctx;    /* the coroutine */
+  coro_context caller; /* whoever resumed it */
+  coro_asym *resumer;  /* the coroutine that resumed it, if any */
+  coro_asym_func func;
+  void *value;         /* the first value, until it starts */
+  int status;
+# if CORO_ASM
+  struct coro_shared_stack *shared; /* the stack it runs on, if shared */
+  void *saved;                      /* its frames, while another one runs there */
+  size_t saved_size, saved_alloc;
+# endif
+};
+
+/*
+ * Create an asymmetric coroutine that will run func on the given stack
+ * when it is first resumed. Like coro_create, this is only thread-safe
+ * and reentrant with CORO_ASM.
+ */
+void coro_asym_create (coro_asym *co, coro_asym_func func, void *sptr, size_t ssze);
+
+/*
+ * Free the resources of the coroutine (see coro_destroy). The stack is
+ * yours to free.
+ */
+void coro_asym_destroy (coro_asym *co);
+
+/*
+ * Switch to co, passing it value, and return the value it passes to
+ * coro_yield, or returns from its function with, which can be told apart
+ * by co->status being CORO_ASYM_SUSPENDED or CORO_ASYM_DONE. Resuming a
+ * coroutine that is done or running (i.e. the calling coroutine or one of
+ * its resumers) does nothing and returns 0.
+ */
+void *coro_resume (coro_asym *co, void *value);
+
+/*
+ * Switch back to the resumer of the calling coroutine, which must be an
+ * asymmetric one, passing it value. Returns the value of the next
+ * coro_resume.
+ */
+void *coro_yield (void *value);
+
+/*
+ * Return the asymmetric coroutine running on the calling thread, or 0 if
+ * there is none.
+ */
+coro_asym *coro_asym_current (void);
+
+# if CORO_ASM
+
+/*
+ * Shared stacks, for very many mostly idle coroutines. All coroutines
+ * created with coro_asym_create_shared on the same shared stack run on
+ * it, one at a time. When another one is resumed there, the part of the
+ * stack that the one there uses is copied to a malloc'ed buffer of its
+ * own, and back when it is resumed again. An idle coroutine then costs
+ * only as much memory as its frames (usually a few hundred bytes), at the
+ * price of two copies when resuming a different coroutine than the one
+ * last run on the stack.
+ *
+ * The frames move, so a coroutine must not give out pointers to its
+ * local variables that are used while it is suspended. A coroutine on a
+ * shared stack can only be resumed when the one last run there is
+ * suspended or done, in particular not by a coroutine on the same stack,
+ * and coroutines on the same stack must not run on different threads at
+ * the same time. Only available with CORO_ASM, whose contexts know their
+ * stack pointer.
+ */
+struct coro_shared_stack
+{
+  void *sptr;
+  size_t ssze;
+  coro_asym *owner; /* the coroutine whose frames are on the stack */
+};
+
+void coro_shared_stack_init (struct coro_shared_stack *stack, void *sptr, size_t ssze);
+
+/*
+ * Like coro_asym_create, but the coroutine runs on the given shared
+ * stack. coro_asym_destroy frees its buffer.
+ */
+void coro_asym_create_shared (coro_asym *co, coro_asym_func func, struct coro_shared_stack *stack);
+
+# endif
+
+#endif
+
 #if __cplusplus
 }
 #endif
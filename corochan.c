@@ -0,0 +1,590 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+#include "corochan.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ * A task that has to wait queues a waiter on each channel it waits on
+ * (several with coro_chan_select), all pointing to one wait structure on
+ * its stack, and parks. Whoever wants to wake it takes a waiter off the
+ * queue and claims the wait (WAITING -> CLAIMED), which only one can do,
+ * fills it in and sets DONE (value handed over) or RETRY (try again).
+ *
+ * Everything that touches a wait, including the wakeup, happens under
+ * the lock of the channel its waiter was queued on, and the waiting task
+ * takes the locks of all of them before it returns, so its stack stays
+ * around for as long as anybody might look at it.
+ *
+ * The waiter counts are read without the lock, to keep the fast paths
+ * lock-free. Those change the buffer, then look at the count of the
+ * other side, while the waiting side changes its count, then looks at
+ * the buffer again, with a full barrier in between on both sides. One of
+ * the two will see the other.
+ */
+enum
+{
+  WAIT_WAITING,
+  WAIT_CLAIMED,
+  WAIT_DONE,
+  WAIT_RETRY
+};
+
+struct coro_chan_wait
+{
+  struct coro_task *task;
+  void *value;
+  int index; /* of the channel that handed over the value */
+  int state;
+};
+
+struct coro_chan_waiter
+{
+  struct coro_chan_waiter *next, *prev; /* next is 0 when not queued */
+  struct coro_chan_wait *wait;
+  int index;
+};
+
+/*
+ * The MPMC buffer is Dmitry Vyukov's bounded queue, where the sequence
+ * number of each cell tells whose turn it is, the SPSC one a plain ring,
+ * where each side caches the other's index.
+ */
+struct coro_chan_cell
+{
+  unsigned long seq;
+  void *value;
+};
+
+struct coro_chan
+{
+  unsigned long tail __attribute__ ((__aligned__ (64)));
+  unsigned long head_cache; /* SPSC: the sender's copy of head */
+  unsigned long head __attribute__ ((__aligned__ (64)));
+  unsigned long tail_cache; /* SPSC: the receiver's copy of tail */
+
+  pthread_mutex_t lock __attribute__ ((__aligned__ (64)));
+  struct coro_chan_waiter recvq, sendq; /* list heads */
+  int nrecv, nsend; /* queued waiters */
+  int closed;
+
+  int spsc;
+  unsigned long mask;
+  struct coro_chan_cell *cell;
+};
+
+struct coro_chan *
+coro_chan_new (unsigned int capacity, int flags)
+{
+  struct coro_chan *chan;
+  unsigned long size = 1, i;
+
+  while (size < capacity)
+    size *= 2;
+
+  if (posix_memalign ((void **)&chan, 64, sizeof (struct coro_chan)))
+    return 0;
+
+  chan->cell = (struct coro_chan_cell *)malloc (size * sizeof (struct coro_chan_cell));
+
+  if (!chan->cell)
+    {
+      free (chan);
+      return 0;
+    }
+
+  for (i = 0; i < size; ++i)
+    chan->cell [i].seq = i;
+
+  chan->tail = chan->head_cache = 0;
+  chan->head = chan->tail_cache = 0;
+  pthread_mutex_init (&chan->lock, 0);
+  chan->recvq.next = chan->recvq.prev = &chan->recvq;
+  chan->sendq.next = chan->sendq.prev = &chan->sendq;
+  chan->nrecv  = chan->nsend = 0;
+  chan->closed = 0;
+  chan->spsc   = flags & CORO_CHAN_SPSC;
+  chan->mask   = size - 1;
+
+  return chan;
+}
+
+void
+coro_chan_free (struct coro_chan *chan)
+{
+  pthread_mutex_destroy (&chan->lock);
+  free (chan->cell);
+  free (chan);
+}
+
+/*****************************************************************************/
+
+static int
+coro_chan_push (struct coro_chan *chan, void *value)
+{
+  if (chan->spsc)
+    {
+      unsigned long tail = chan->tail;
+
+      if (tail - chan->head_cache > chan->mask)
+        {
+          chan->head_cache = __atomic_load_n (&chan->head, __ATOMIC_ACQUIRE);
+
+          if (tail - chan->head_cache > chan->mask)
+            return 0;
+        }
+
+      chan->cell [tail & chan->mask].value = value;
+      __atomic_store_n (&chan->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+  else
+    {
+      unsigned long pos = __atomic_load_n (&chan->tail, __ATOMIC_RELAXED);
+      struct coro_chan_cell *cell;
+
+      for (;;)
+        {
+          long diff;
+
+          cell = chan->cell + (pos & chan->mask);
+          diff = (long)(__atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE) - pos);
+
+          if (!diff)
+            {
+              if (__atomic_compare_exchange_n (&chan->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            }
+          else if (diff < 0)
+            return 0; /* full */
+          else
+            pos = __atomic_load_n (&chan->tail, __ATOMIC_RELAXED);
+        }
+
+      cell->value = value;
+      __atomic_store_n (&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    }
+
+  return 1;
+}
+
+static int
+coro_chan_pop (struct coro_chan *chan, void **value)
+{
+  if (chan->spsc)
+    {
+      unsigned long head = chan->head;
+
+      if (head == chan->tail_cache)
+        {
+          chan->tail_cache = __atomic_load_n (&chan->tail, __ATOMIC_ACQUIRE);
+
+          if (head == chan->tail_cache)
+            return 0;
+        }
+
+      *value = chan->cell [head & chan->mask].value;
+      __atomic_store_n (&chan->head, head + 1, __ATOMIC_RELEASE);
+    }
+  else
+    {
+      unsigned long pos = __atomic_load_n (&chan->head, __ATOMIC_RELAXED);
+      struct coro_chan_cell *cell;
+
+      for (;;)
+        {
+          long diff;
+
+          cell = chan->cell + (pos & chan->mask);
+          diff = (long)(__atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+          if (!diff)
+            {
+              if (__atomic_compare_exchange_n (&chan->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            }
+          else if (diff < 0)
+            return 0; /* empty */
+          else
+            pos = __atomic_load_n (&chan->head, __ATOMIC_RELAXED);
+        }
+
+      *value = cell->value;
+      __atomic_store_n (&cell->seq, pos + chan->mask + 1, __ATOMIC_RELEASE);
+    }
+
+  return 1;
+}
+
+/* whether a pop might succeed, without doing it */
+static int
+coro_chan_readable (struct coro_chan *chan)
+{
+  unsigned long head = __atomic_load_n (&chan->head, __ATOMIC_RELAXED);
+
+  if (chan->spsc)
+    return __atomic_load_n (&chan->tail, __ATOMIC_ACQUIRE) != head;
+
+  return __atomic_load_n (&chan->cell [head & chan->mask].seq, __ATOMIC_ACQUIRE) == head + 1;
+}
+
+/* whether a push might succeed, without doing it */
+static int
+coro_chan_writable (struct coro_chan *chan)
+{
+  unsigned long tail = __atomic_load_n (&chan->tail, __ATOMIC_RELAXED);
+
+  if (chan->spsc)
+    return tail - __atomic_load_n (&chan->head, __ATOMIC_ACQUIRE) <= chan->mask;
+
+  return __atomic_load_n (&chan->cell [tail & chan->mask].seq, __ATOMIC_ACQUIRE) == tail;
+}
+
+/*****************************************************************************/
+
+/* called with the lock held */
+static void
+coro_chan_enqueue (struct coro_chan_waiter *q, int *count, struct coro_chan_waiter *w)
+{
+  w->next = q;
+  w->prev = q->prev;
+  q->prev->next = w;
+  q->prev = w;
+
+  __atomic_add_fetch (count, 1, __ATOMIC_SEQ_CST);
+}
+
+/* called with the lock held */
+static void
+coro_chan_dequeue (struct coro_chan_waiter *w, int *count)
+{
+  w->prev->next = w->next;
+  w->next->prev = w->prev;
+  w->next = 0;
+
+  __atomic_sub_fetch (count, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Take waiters off q until one whose wait can be claimed turns up, and
+ * return its wait, or 0. Waiters whose wait was claimed through another
+ * channel are just dropped. Called with the lock held.
+ */
+static struct coro_chan_wait *
+coro_chan_claim (struct coro_chan_waiter *q, int *count)
+{
+  while (q->next != q)
+    {
+      struct coro_chan_waiter *w = q->next;
+      struct coro_chan_wait *wait = w->wait;
+      int waiting = WAIT_WAITING;
+
+      coro_chan_dequeue (w, count);
+
+      if (__atomic_compare_exchange_n (&wait->state, &waiting, WAIT_CLAIMED, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+          wait->index = w->index;
+          return wait;
+        }
+    }
+
+  return 0;
+}
+
+/* tell up to n waiters on q to try again, after the buffer or the channel changed */
+static void
+coro_chan_wake (struct coro_chan *chan, struct coro_chan_waiter *q, int *count, unsigned int n)
+{
+  struct coro_chan_wait *wait;
+
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+  if (!__atomic_load_n (count, __ATOMIC_RELAXED))
+    return;
+
+  pthread_mutex_lock (&chan->lock);
+
+  while (n-- && (wait = coro_chan_claim (q, count)))
+    {
+      __atomic_store_n (&wait->state, WAIT_RETRY, __ATOMIC_RELEASE);
+      coro_sched_unpark (wait->task);
+    }
+
+  pthread_mutex_unlock (&chan->lock);
+}
+
+/*
+ * Hand up to n values straight to waiting receivers, returns how many
+ * were taken. With handoff set, switch to the (only) receiver right away.
+ * Only done while the buffer is empty, as a receiver can queue itself
+ * before it notices what is still in there, and the values must not
+ * overtake that.
+ */
+static unsigned int
+coro_chan_deliver (struct coro_chan *chan, void *const *values, unsigned int n, int handoff)
+{
+  struct coro_task *task = 0;
+  struct coro_chan_wait *wait;
+  unsigned int done = 0;
+
+  pthread_mutex_lock (&chan->lock);
+
+  if (coro_chan_readable (chan))
+    n = 0;
+
+  while (done < n && (wait = coro_chan_claim (&chan->recvq, &chan->nrecv)))
+    {
+      struct coro_task *receiver = wait->task;
+
+      wait->value = values [done++];
+      __atomic_store_n (&wait->state, WAIT_DONE, __ATOMIC_RELEASE);
+
+      if (!handoff)
+        coro_sched_unpark (receiver);
+      else if (coro_sched_claim (receiver))
+        task = receiver;
+    }
+
+  pthread_mutex_unlock (&chan->lock);
+
+  if (task)
+    coro_sched_handoff (task);
+
+  return done;
+}
+
+/*
+ * Queue the calling sender and park until a receiver makes room or the
+ * channel is closed. The waiter is off the queue when this returns.
+ */
+static void
+coro_chan_wait_room (struct coro_chan *chan)
+{
+  struct coro_chan_wait wait;
+  struct coro_chan_waiter waiter;
+
+  wait.task  = coro_sched_self ();
+  wait.state = WAIT_WAITING;
+
+  waiter.wait  = &wait;
+  waiter.index = 0;
+
+  pthread_mutex_lock (&chan->lock);
+  coro_chan_enqueue (&chan->sendq, &chan->nsend, &waiter);
+  pthread_mutex_unlock (&chan->lock);
+
+  /* room made or a close before we were queued is ours to notice */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+  if (coro_chan_writable (chan) || __atomic_load_n (&chan->closed, __ATOMIC_ACQUIRE))
+    {
+      int waiting = WAIT_WAITING;
+
+      __atomic_compare_exchange_n (&wait.state, &waiting, WAIT_RETRY, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+
+  while (__atomic_load_n (&wait.state, __ATOMIC_ACQUIRE) < WAIT_DONE)
+    coro_sched_park ();
+
+  pthread_mutex_lock (&chan->lock);
+  if (waiter.next)
+    coro_chan_dequeue (&waiter, &chan->nsend);
+  pthread_mutex_unlock (&chan->lock);
+}
+
+/*****************************************************************************/
+
+int
+coro_chan_try_send (struct coro_chan *chan, void *value)
+{
+  if (__atomic_load_n (&chan->closed, __ATOMIC_ACQUIRE))
+    return 0;
+
+  if (__atomic_load_n (&chan->nrecv, __ATOMIC_ACQUIRE) && coro_chan_deliver (chan, &value, 1, 1))
+    return 1;
+
+  if (!coro_chan_push (chan, value))
+    return 0;
+
+  coro_chan_wake (chan, &chan->recvq, &chan->nrecv, 1);
+
+  return 1;
+}
+
+int
+coro_chan_send (struct coro_chan *chan, void *value)
+{
+  for (;;)
+    {
+      if (coro_chan_try_send (chan, value))
+        return 1;
+
+      if (__atomic_load_n (&chan->closed, __ATOMIC_ACQUIRE))
+        return 0;
+
+      coro_chan_wait_room (chan);
+    }
+}
+
+int
+coro_chan_try_recv (struct coro_chan *chan, void **value)
+{
+  if (!coro_chan_pop (chan, value))
+    return 0;
+
+  coro_chan_wake (chan, &chan->sendq, &chan->nsend, 1);
+
+  return 1;
+}
+
+int
+coro_chan_recv (struct coro_chan *chan, void **value)
+{
+  return coro_chan_select (&chan, 1, value) == 0;
+}
+
+int
+coro_chan_select (struct coro_chan *const *chans, unsigned int count, void **value)
+{
+  struct coro_chan_waiter waiters [CORO_CHAN_SELECT_MAX];
+
+  if (count > CORO_CHAN_SELECT_MAX)
+    abort ();
+
+  for (;;)
+    {
+      struct coro_chan_wait wait;
+      unsigned int i, open = 0;
+      int state;
+
+      for (i = 0; i < count; ++i)
+        if (coro_chan_try_recv (chans [i], value))
+          return i;
+
+      /* values sent before a close are visible once the close is */
+      for (i = 0; i < count; ++i)
+        if (!__atomic_load_n (&chans [i]->closed, __ATOMIC_ACQUIRE))
+          ++open;
+        else if (coro_chan_try_recv (chans [i], value))
+          return i;
+
+      if (!open)
+        return -1;
+
+      wait.task  = coro_sched_self ();
+      wait.state = WAIT_WAITING;
+
+      for (i = 0; i < count; ++i)
+        {
+          waiters [i].wait  = &wait;
+          waiters [i].index = i;
+
+          pthread_mutex_lock (&chans [i]->lock);
+          coro_chan_enqueue (&chans [i]->recvq, &chans [i]->nrecv, waiters + i);
+          pthread_mutex_unlock (&chans [i]->lock);
+        }
+
+      /* something sent or closed before we were queued is ours to notice */
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+      for (i = 0; i < count; ++i)
+        if (coro_chan_readable (chans [i]) || __atomic_load_n (&chans [i]->closed, __ATOMIC_ACQUIRE))
+          {
+            int waiting = WAIT_WAITING;
+
+            __atomic_compare_exchange_n (&wait.state, &waiting, WAIT_RETRY, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            break;
+          }
+
+      while ((state = __atomic_load_n (&wait.state, __ATOMIC_ACQUIRE)) < WAIT_DONE)
+        coro_sched_park ();
+
+      for (i = 0; i < count; ++i)
+        {
+          pthread_mutex_lock (&chans [i]->lock);
+          if (waiters [i].next)
+            coro_chan_dequeue (waiters + i, &chans [i]->nrecv);
+          pthread_mutex_unlock (&chans [i]->lock);
+        }
+
+      if (state == WAIT_DONE)
+        {
+          *value = wait.value;
+          return wait.index;
+        }
+    }
+}
+
+unsigned int
+coro_chan_send_n (struct coro_chan *chan, void *const *values, unsigned int count)
+{
+  unsigned int n = 0;
+
+  while (n < count && !__atomic_load_n (&chan->closed, __ATOMIC_ACQUIRE))
+    {
+      unsigned int pushed = 0;
+
+      /* receivers that are waiting already get theirs directly */
+      if (__atomic_load_n (&chan->nrecv, __ATOMIC_ACQUIRE))
+        n += coro_chan_deliver (chan, values + n, count - n, 0);
+
+      while (n < count && coro_chan_push (chan, values [n]))
+        ++n, ++pushed;
+
+      if (pushed)
+        coro_chan_wake (chan, &chan->recvq, &chan->nrecv, pushed);
+
+      /* full, so wait for room */
+      if (n < count && !pushed)
+        {
+          if (!coro_chan_send (chan, values [n]))
+            break;
+
+          ++n;
+        }
+    }
+
+  return n;
+}
+
+unsigned int
+coro_chan_recv_n (struct coro_chan *chan, void **values, unsigned int count)
+{
+  unsigned int n = 0;
+
+  if (!count)
+    return 0;
+
+  while (n < count && coro_chan_pop (chan, values + n))
+    ++n;
+
+  if (!n)
+    {
+      if (!coro_chan_recv (chan, values))
+        return 0;
+
+      n = 1;
+
+      while (n < count && coro_chan_pop (chan, values + n))
+        ++n;
+
+      if (n > 1)
+        coro_chan_wake (chan, &chan->sendq, &chan->nsend, n - 1);
+    }
+  else
+    coro_chan_wake (chan, &chan->sendq, &chan->nsend, n);
+
+  return n;
+}
+
+void
+coro_chan_close (struct coro_chan *chan)
+{
+  __atomic_store_n (&chan->closed, 1, __ATOMIC_SEQ_CST);
+
+  coro_chan_wake (chan, &chan->recvq, &chan->nrecv, ~0U);
+  coro_chan_wake (chan, &chan->sendq, &chan->nsend, ~0U);
+}
@@ -0,0 +1,112 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+/*
+ * Bounded channels between the tasks of the scheduler in corosched.h.
+ *
+ * A channel is a ring buffer of pointers, a single-producer
+ * single-consumer one (CORO_CHAN_SPSC) or a multi-producer
+ * multi-consumer one (CORO_CHAN_MPMC). Sending to a channel with room,
+ * and receiving from one that is not empty, is lock-free, also when
+ * sender and receiver run on different threads. The channel's mutex is
+ * only taken when someone has to wait, or somebody is waiting.
+ *
+ * When a receiver is waiting, a sender does not go through the buffer,
+ * but hands the value to the receiver and switches to it right away
+ * (coro_sched_handoff), so a consumer gets to run immediately, usually
+ * on the same cpu, with the value still in its cache.
+ *
+ * The blocking functions must be called from tasks. The others, and
+ * blocking ones that need not block, can also be called from other
+ * threads.
+ *
+ * Built together with the scheduler (-Dsched=true).
+ */
+
+#ifndef COROCHAN_H
+#define COROCHAN_H
+
+#include "corosched.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct coro_chan;
+
+enum
+{
+  CORO_CHAN_MPMC = 0,
+  CORO_CHAN_SPSC = 1 /* at most one task sends and one receives at any time */
+};
+
+/* the most channels coro_chan_select can wait on */
+#define CORO_CHAN_SELECT_MAX 64
+
+/*
+ * Create a channel that buffers up to capacity values (rounded up to a
+ * power of two, at least one). flags is CORO_CHAN_MPMC or
+ * CORO_CHAN_SPSC. Returns 0 on failure.
+ */
+struct coro_chan *coro_chan_new (unsigned int capacity, int flags);
+
+/*
+ * Free the channel. Nobody must be using it anymore.
+ */
+void coro_chan_free (struct coro_chan *chan);
+
+/*
+ * Mark the channel as closed: sends fail from now on, and receives fail
+ * once the buffered values are gone. Wakes up everybody waiting on it.
+ * Must not be called while sends are in progress, i.e. it is for the
+ * sending side to say it is done.
+ */
+void coro_chan_close (struct coro_chan *chan);
+
+/*
+ * Send value, waiting for room in the buffer if need be. Returns false
+ * if the channel is closed.
+ */
+int coro_chan_send (struct coro_chan *chan, void *value);
+
+/*
+ * Receive a value into *value, waiting for one if need be. Returns false
+ * if the channel is closed and empty.
+ */
+int coro_chan_recv (struct coro_chan *chan, void **value);
+
+/*
+ * Like coro_chan_send and coro_chan_recv, but return false instead of
+ * waiting.
+ */
+int coro_chan_try_send (struct coro_chan *chan, void *value);
+int coro_chan_try_recv (struct coro_chan *chan, void **value);
+
+/*
+ * Send the count values, waiting as need be, waking up all receivers
+ * that can get one at once. Returns the number of values sent, which is
+ * less than count only if the channel got closed.
+ */
+unsigned int coro_chan_send_n (struct coro_chan *chan, void *const *values, unsigned int count);
+
+/*
+ * Receive up to count values, waiting only for the first one. Returns
+ * the number of values received, 0 if the channel is closed and empty.
+ */
+unsigned int coro_chan_recv_n (struct coro_chan *chan, void **values, unsigned int count);
+
+/*
+ * Receive a value from whichever of the count (up to
+ * CORO_CHAN_SELECT_MAX) channels has one first, preferring earlier ones
+ * if several have. Returns the index of that channel, or -1 if all of
+ * them are closed and empty.
+ */
+int coro_chan_select (struct coro_chan *const *chans, unsigned int count, void **value);
+
+#if __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+#define _GNU_SOURCE /* accept4 */
+
+#include "coroepoll.h"
+#include "corotimer.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !CORO_STACKALLOC
+# error coroepoll needs the stack management functions (CORO_STACKALLOC)
+#endif
+
+#if !CORO_ASYM
+# error coroepoll needs the asymmetric coroutines (CORO_ASYM)
+#endif
+
+/* ready events handed out per epoll_wait */
+#define CORO_EPOLL_EVENTS 256
+
+struct coro_epoll_task
+{
+  coro_asym co; /* must be first, coro_asym_current () is the task */
+  struct coro_stack stack;
+  coro_func func;
+  void *arg;
+  struct coro_epoll_task *next; /* run queue link */
+};
+
+/*
+ * The cached state of an fd. ready collects the edges reported since
+ * the last coro_epoll_wait consumed them, in and out are the coroutines
+ * waiting for input and output readiness.
+ */
+struct coro_epoll_fd
+{
+  unsigned int registered;
+  unsigned int ready;
+  struct coro_epoll_task *in, *out;
+};
+
+struct coro_epoll
+{
+  int fd;
+  int nfds;
+  struct coro_epoll_fd *fds; /* indexed by fd */
+  unsigned int ntasks;
+  struct coro_epoll_task *runq, **runq_tail;
+  struct coro_wheel wheel; /* sleeping tasks, in milliseconds */
+  struct epoll_event events [CORO_EPOLL_EVENTS];
+};
+
+static uint64_t
+coro_epoll_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct coro_epoll *
+coro_epoll_new (void)
+{
+  struct coro_epoll *ep = (struct coro_epoll *)calloc (1, sizeof (struct coro_epoll));
+
+  if (!ep)
+    return 0;
+
+  ep->fd = epoll_create1 (EPOLL_CLOEXEC);
+
+  if (ep->fd < 0)
+    {
+      int err = errno;
+
+      free (ep);
+      errno = err;
+      return 0;
+    }
+
+  ep->runq_tail = &ep->runq;
+  coro_wheel_init (&ep->wheel, coro_epoll_now ());
+
+  return ep;
+}
+
+void
+coro_epoll_free (struct coro_epoll *ep)
+{
+  close (ep->fd);
+  free (ep->fds);
+  free (ep);
+}
+
+static void *
+coro_epoll_start (void *value)
+{
+  struct coro_epoll_task *task = (struct coro_epoll_task *)coro_asym_current ();
+
+  (void)value;
+  task->func (task->arg);
+
+  return 0;
+}
+
+static void
+coro_epoll_ready (struct coro_epoll *ep, struct coro_epoll_task *task)
+{
+  task->next = 0;
+  *ep->runq_tail = task;
+  ep->runq_tail = &task->next;
+}
+
+int
+coro_epoll_spawn (struct coro_epoll *ep, coro_func func, void *arg, unsigned int size)
+{
+  struct coro_epoll_task *task = (struct coro_epoll_task *)malloc (sizeof (struct coro_epoll_task));
+
+  if (!task)
+    return 0;
+
+  if (!coro_stack_alloc (&task->stack, size))
+    {
+      free (task);
+      return 0;
+    }
+
+  task->func = func;
+  task->arg  = arg;
+
+  coro_asym_create (&task->co, coro_epoll_start, task->stack.sptr, task->stack.ssze);
+
+  ++ep->ntasks;
+  coro_epoll_ready (ep, task);
+
+  return 1;
+}
+
+void
+coro_epoll_yield (struct coro_epoll *ep)
+{
+  coro_epoll_ready (ep, (struct coro_epoll_task *)coro_asym_current ());
+  coro_yield (0);
+}
+
+int
+coro_epoll_sleep (struct coro_epoll *ep, unsigned int msec)
+{
+  struct coro_timer t;
+
+  t.prev = 0;
+  t.data = coro_asym_current ();
+  /* the clock is truncated to milliseconds, so round up */
+  coro_timer_arm (&ep->wheel, &t, coro_epoll_now () + msec + (msec > 0));
+
+  coro_yield (0);
+
+  return 0;
+}
+
+/*
+ * Bring the wheel up to date and queue the sleepers that are due, just
+ * before polling, so the poll timeout is measured from now.
+ */
+static void
+coro_epoll_timers (struct coro_epoll *ep)
+{
+  struct coro_timer *t;
+
+  if (coro_wheel_timeout (&ep->wheel) == UINT64_MAX)
+    return;
+
+  coro_wheel_advance (&ep->wheel, coro_epoll_now ());
+
+  while ((t = coro_wheel_expired (&ep->wheel)))
+    coro_epoll_ready (ep, (struct coro_epoll_task *)t->data);
+}
+
+int
+coro_epoll_run (struct coro_epoll *ep)
+{
+  while (ep->ntasks)
+    {
+      struct coro_epoll_task *task = ep->runq;
+      uint64_t timeout;
+      int i, n;
+
+      /* whatever gets queued while running these waits for the next round */
+      ep->runq = 0;
+      ep->runq_tail = &ep->runq;
+
+      while (task)
+        {
+          struct coro_epoll_task *next = task->next;
+
+          coro_resume (&task->co, 0);
+
+          if (task->co.status == CORO_ASYM_DONE)
+            {
+              coro_asym_destroy (&task->co);
+              coro_stack_free (&task->stack);
+              free (task);
+              --ep->ntasks;
+            }
+
+          task = next;
+        }
+
+      if (!ep->ntasks)
+        break;
+
+      coro_epoll_timers (ep);
+
+      timeout = ep->runq ? 0 : coro_wheel_timeout (&ep->wheel);
+      n = epoll_wait (ep->fd, ep->events, CORO_EPOLL_EVENTS,
+                      timeout == UINT64_MAX ? -1 : timeout > INT_MAX ? INT_MAX : (int)timeout);
+
+      if (n < 0)
+        {
+          if (errno != EINTR)
+            return -1;
+
+          n = 0;
+        }
+
+      /* queue all waiters first, so resuming them cannot move ep->fds under us */
+      for (i = 0; i < n; ++i)
+        {
+          unsigned int events = ep->events [i].events;
+          struct coro_epoll_fd *f = ep->fds + ep->events [i].data.fd;
+
+          f->ready |= events;
+
+          if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && f->in)
+            {
+              if (f->out == f->in)
+                f->out = 0;
+
+              coro_epoll_ready (ep, f->in);
+              f->in = 0;
+            }
+
+          if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && f->out)
+            {
+              if (f->in == f->out)
+                f->in = 0;
+
+              coro_epoll_ready (ep, f->out);
+              f->out = 0;
+            }
+        }
+    }
+
+  return 0;
+}
+
+static struct coro_epoll_fd *
+coro_epoll_fd (struct coro_epoll *ep, int fd)
+{
+  if (fd >= ep->nfds)
+    {
+      int nfds = ep->nfds ? ep->nfds : 64;
+      struct coro_epoll_fd *fds;
+
+      while (nfds <= fd)
+        nfds *= 2;
+
+      fds = (struct coro_epoll_fd *)realloc (ep->fds, nfds * sizeof (struct coro_epoll_fd));
+
+      if (!fds)
+        return 0;
+
+      memset (fds + ep->nfds, 0, (nfds - ep->nfds) * sizeof (struct coro_epoll_fd));
+      ep->fds  = fds;
+      ep->nfds = nfds;
+    }
+
+  return ep->fds + fd;
+}
+
+int
+coro_epoll_wait (struct coro_epoll *ep, int fd, int events)
+{
+  struct coro_epoll_task *self = (struct coro_epoll_task *)coro_asym_current ();
+  struct coro_epoll_fd *f;
+  unsigned int mask, ready;
+
+  if (fd < 0)
+    return -EBADF;
+
+  if (!(f = coro_epoll_fd (ep, fd)))
+    return -ENOMEM;
+
+  if (!f->registered)
+    {
+      struct epoll_event ev;
+
+      ev.events  = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.fd = fd;
+
+      if (epoll_ctl (ep->fd, EPOLL_CTL_ADD, fd, &ev) && errno != EEXIST)
+        return -errno;
+
+      f->registered = 1;
+    }
+
+  events &= EPOLLIN | EPOLLOUT;
+  /* a peer that stopped writing only ends our reading */
+  mask = events | (events & EPOLLIN ? EPOLLRDHUP : 0) | EPOLLERR | EPOLLHUP;
+  ready = f->ready & mask;
+
+  if (!ready)
+    {
+      if (((events & EPOLLIN) && f->in) || ((events & EPOLLOUT) && f->out))
+        return -EBUSY;
+
+      if (events & EPOLLIN)
+        f->in = self;
+
+      if (events & EPOLLOUT)
+        f->out = self;
+
+      coro_yield (0);
+
+      /* other coroutines might have grown the table meanwhile */
+      f = ep->fds + fd;
+      ready = f->ready & mask;
+
+      /* woken by something else, so nobody must queue us from here later */
+      if (f->in == self)
+        f->in = 0;
+
+      if (f->out == self)
+        f->out = 0;
+    }
+
+  /* errors and hangups stay, the fd is not going to get any better */
+  f->ready &= ~events;
+
+  return ready;
+}
+
+int
+coro_epoll_close (struct coro_epoll *ep, int fd)
+{
+  if (fd >= 0 && fd < ep->nfds)
+    memset (ep->fds + fd, 0, sizeof (struct coro_epoll_fd));
+
+  return close (fd);
+}
+
+int
+coro_epoll_read (struct coro_epoll *ep, int fd, void *buf, unsigned int len, off_t offset)
+{
+  for (;;)
+    {
+      ssize_t res = offset == -1 ? read (fd, buf, len) : pread (fd, buf, len, offset);
+      int ready;
+
+      if (res >= 0)
+        return res;
+
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -errno;
+
+      if ((ready = coro_epoll_wait (ep, fd, EPOLLIN)) < 0)
+        return ready;
+    }
+}
+
+int
+coro_epoll_write (struct coro_epoll *ep, int fd, const void *buf, unsigned int len, off_t offset)
+{
+  for (;;)
+    {
+      ssize_t res = offset == -1 ? write (fd, buf, len) : pwrite (fd, buf, len, offset);
+      int ready;
+
+      if (res >= 0)
+        return res;
+
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -errno;
+
+      if ((ready = coro_epoll_wait (ep, fd, EPOLLOUT)) < 0)
+        return ready;
+    }
+}
+
+int
+coro_epoll_accept (struct coro_epoll *ep, int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+  for (;;)
+    {
+      int res = accept4 (fd, addr, addrlen, SOCK_NONBLOCK);
+
+      if (res >= 0)
+        return res;
+
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -errno;
+
+      if ((res = coro_epoll_wait (ep, fd, EPOLLIN)) < 0)
+        return res;
+    }
+}
+
+int
+coro_epoll_connect (struct coro_epoll *ep, int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+  socklen_t len = sizeof (int);
+  int err;
+
+  if (!connect (fd, addr, addrlen))
+    return 0;
+
+  /* an interrupted connect carries on in the background, just like a non-blocking one */
+  if (errno != EINPROGRESS && errno != EINTR)
+    return -errno;
+
+  if ((err = coro_epoll_wait (ep, fd, EPOLLOUT)) < 0)
+    return err;
+
+  if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len))
+    return -errno;
+
+  return -err;
+}
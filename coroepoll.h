@@ -0,0 +1,116 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+/*
+ * An optional epoll reactor for Linux, for where io_uring is not
+ * available (see corouring.h, whose interface it mirrors): coroutines
+ * started with coro_epoll_spawn use non-blocking fds, and when an
+ * operation would block, coro_epoll_wait switches back to the reactor
+ * loop until the fd becomes ready. Each loop iteration collects all
+ * ready fds with one epoll_wait, then resumes their coroutines.
+ *
+ * Every fd is registered once, edge-triggered for both directions, the
+ * first time a coroutine waits on it, and stays registered until
+ * coro_epoll_close, so waiting does not need any epoll_ctl calls. The
+ * price is that fds must be closed with coro_epoll_close, or the
+ * reactor would believe a reused fd number to be registered already.
+ *
+ * As with corouring.h, a reactor and its coroutines belong to the thread
+ * running coro_epoll_run, and the I/O functions must be called from the
+ * coroutine the reactor started. Build with -Depoll=true to include it
+ * in the library.
+ */
+
+#ifndef COROEPOLL_H
+#define COROEPOLL_H
+
+#include "coro.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct coro_epoll;
+
+/*
+ * Create a reactor. Returns 0 and sets errno on failure.
+ */
+struct coro_epoll *coro_epoll_new (void);
+
+/*
+ * Free the reactor. It must not have any coroutines left, i.e.
+ * coro_epoll_run must have returned. The fds it knows about are not
+ * closed.
+ */
+void coro_epoll_free (struct coro_epoll *ep);
+
+/*
+ * Start a new coroutine running func (arg) on a stack of the given size
+ * (as for coro_stack_alloc) the next time the reactor loop gets around
+ * to it. Its memory is released when func returns. Can be called from
+ * the reactor's coroutines or before coro_epoll_run. Returns false if
+ * the memory could not be allocated.
+ */
+int coro_epoll_spawn (struct coro_epoll *ep, coro_func func, void *arg, unsigned int size);
+
+/*
+ * Run the reactor loop until all of its coroutines have returned.
+ * Returns 0, or -1 with errno set if epoll_wait failed.
+ */
+int coro_epoll_run (struct coro_epoll *ep);
+
+/*
+ * Suspend the calling coroutine until fd becomes ready for events
+ * (EPOLLIN, EPOLLOUT or both), or return at once if that happened since
+ * the last coro_epoll_wait for these events returned, as it might have
+ * been missed otherwise. So call it after an operation failed with
+ * EAGAIN, and retry the operation afterwards.
+ *
+ * Returns the events that are ready, possibly including EPOLLERR,
+ * EPOLLHUP or, when waiting for input, EPOLLRDHUP, or -errno. Only one coroutine can wait for
+ * each direction of an fd, others get -EBUSY.
+ */
+int coro_epoll_wait (struct coro_epoll *ep, int fd, int events);
+
+/*
+ * Forget fd and close it. It must not have any waiters.
+ */
+int coro_epoll_close (struct coro_epoll *ep, int fd);
+
+/*
+ * Like the coro_uring functions, these suspend the calling coroutine
+ * until the operation is done and return what the system call would
+ * have returned, except that errors are returned as -errno. fd must be
+ * non-blocking. offset is the file position to read/write at, -1 means
+ * the current one. Accepted sockets are non-blocking.
+ */
+int coro_epoll_read (struct coro_epoll *ep, int fd, void *buf, unsigned int len, off_t offset);
+int coro_epoll_write (struct coro_epoll *ep, int fd, const void *buf, unsigned int len, off_t offset);
+int coro_epoll_accept (struct coro_epoll *ep, int fd, struct sockaddr *addr, socklen_t *addrlen);
+int coro_epoll_connect (struct coro_epoll *ep, int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * Let the other coroutines of the reactor run, the calling one is
+ * resumed after the next epoll_wait.
+ */
+void coro_epoll_yield (struct coro_epoll *ep);
+
+/*
+ * Suspend the calling coroutine for at least msec milliseconds. The
+ * sleepers are kept in a timer wheel (see corotimer.h), and epoll_wait
+ * blocks no longer than until the first of them is due. Returns 0, like
+ * coro_uring_sleep.
+ */
+int coro_epoll_sleep (struct coro_epoll *ep, unsigned int msec);
+
+#if __cplusplus
+}
+#endif
+
+#endif
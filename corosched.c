@@ -0,0 +1,747 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+#include "corosched.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if !CORO_STACKALLOC
+# error corosched needs the stack management functions (CORO_STACKALLOC)
+#endif
+
+#if CORO_FIBER || CORO_PTHREAD
+# error corosched does not work with CORO_FIBER or CORO_PTHREAD
+#endif
+
+/*
+ * A task is RUNNING while on a worker. It sets YIELDING, PARKING or DONE
+ * before switching back to the worker, which then requeues it, marks it
+ * PARKED or frees it. A task only ever becomes READY (and gets queued)
+ * once it is off its stack.
+ */
+enum
+{
+  TASK_RUNNING,
+  TASK_YIELDING,
+  TASK_PARKING,
+  TASK_PARKED,
+  TASK_READY,
+  TASK_DONE
+};
+
+struct coro_task
+{
+  coro_context ctx;
+  struct coro_stack stack;
+  coro_func func;
+  void *arg;
+  struct coro_sched *sched;
+  struct coro_worker *worker; /* the worker running it */
+  struct coro_task *next; /* global queue link */
+  int state;
+  int notified; /* unpark permit */
+};
+
+/*
+ * Chase-Lev work-stealing deque, as in "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (Lê et al., 2013). The owning
+ * worker pushes and takes at the bottom, thieves steal from the top.
+ * Outgrown buffers are kept until the scheduler is freed, as thieves
+ * might still be reading them.
+ */
+struct coro_deque_buf
+{
+  long size; /* a power of two */
+  struct coro_deque_buf *prev;
+  struct coro_task *slot [1];
+};
+
+struct coro_deque
+{
+  long top __attribute__ ((__aligned__ (64)));
+  long bottom __attribute__ ((__aligned__ (64)));
+  struct coro_deque_buf *buf;
+};
+
+struct coro_worker
+{
+  struct coro_deque deque;
+  coro_context ctx; /* the "empty" context the worker loop runs in */
+  struct coro_task *current;
+  struct coro_task *handed; /* switched away from by coro_sched_handoff, to be queued */
+  int yielded; /* the last task yielded, so take the next one from the top */
+  struct coro_sched *sched;
+  unsigned int seed;
+  pthread_t thread;
+} __attribute__ ((__aligned__ (64)));
+
+struct coro_sched
+{
+  unsigned int nworkers;
+  struct coro_worker *workers;
+
+  pthread_mutex_t lock;  /* protects the global queue and stop */
+  pthread_cond_t wake;   /* idle workers sleep here */
+  pthread_cond_t done;   /* coro_sched_wait sleeps here */
+  struct coro_task *head, *tail;
+  long queued;           /* length of the global queue, for unlocked peeks */
+  int idle;              /* number of sleeping workers */
+  int stop;
+  long ntasks;
+};
+
+#define CORO_DEQUE_INITIAL 64
+
+static __thread struct coro_worker *coro_sched_worker;
+
+#if !CORO_ASM
+/* only the asm backend's coro_create is reentrant */
+static pthread_mutex_t coro_sched_create_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Tasks can be resumed on a different thread than they were suspended on,
+ * so the worker must be looked up again after every switch, without
+ * reusing a thread-local address that was computed before it (see
+ * "moving coroutines between threads" in coro.h).
+ */
+CORO_TLS_ACCESSOR (struct coro_worker *, coro_sched_worker_location, coro_sched_worker)
+
+static struct coro_worker *
+coro_sched_worker_self (void)
+{
+  return *coro_sched_worker_location ();
+}
+
+static struct coro_task *
+coro_sched_current (void)
+{
+  struct coro_worker *worker = coro_sched_worker_self ();
+
+  return worker ? worker->current : 0;
+}
+
+/* like coro_sched_current, for functions that must be called from a task */
+static struct coro_task *
+coro_sched_task (void)
+{
+  struct coro_task *task = coro_sched_current ();
+
+  if (!task)
+    abort ();
+
+  return task;
+}
+
+/*****************************************************************************/
+
+static struct coro_deque_buf *
+coro_deque_buf_new (long size, struct coro_deque_buf *prev)
+{
+  struct coro_deque_buf *buf = (struct coro_deque_buf *)malloc (sizeof (struct coro_deque_buf)
+                                                                + (size - 1) * sizeof (struct coro_task *));
+
+  if (!buf)
+    abort ();
+
+  buf->size = size;
+  buf->prev = prev;
+
+  return buf;
+}
+
+static void
+coro_deque_init (struct coro_deque *dq)
+{
+  dq->top    = 0;
+  dq->bottom = 0;
+  dq->buf    = coro_deque_buf_new (CORO_DEQUE_INITIAL, 0);
+}
+
+static void
+coro_deque_destroy (struct coro_deque *dq)
+{
+  struct coro_deque_buf *buf = dq->buf;
+
+  while (buf)
+    {
+      struct coro_deque_buf *prev = buf->prev;
+
+      free (buf);
+      buf = prev;
+    }
+}
+
+static struct coro_deque_buf *
+coro_deque_grow (struct coro_deque *dq, struct coro_deque_buf *old, long top, long bottom)
+{
+  struct coro_deque_buf *buf = coro_deque_buf_new (old->size * 2, old);
+  long i;
+
+  for (i = top; i < bottom; ++i)
+    buf->slot [i & (buf->size - 1)] = old->slot [i & (old->size - 1)];
+
+  __atomic_store_n (&dq->buf, buf, __ATOMIC_RELEASE);
+
+  return buf;
+}
+
+static void
+coro_deque_push (struct coro_deque *dq, struct coro_task *task)
+{
+  long b = __atomic_load_n (&dq->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n (&dq->top, __ATOMIC_ACQUIRE);
+  struct coro_deque_buf *buf = __atomic_load_n (&dq->buf, __ATOMIC_RELAXED);
+
+  if (b - t > buf->size - 1)
+    buf = coro_deque_grow (dq, buf, t, b);
+
+  __atomic_store_n (&buf->slot [b & (buf->size - 1)], task, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  __atomic_store_n (&dq->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+static struct coro_task *
+coro_deque_take (struct coro_deque *dq)
+{
+  long b = __atomic_load_n (&dq->bottom, __ATOMIC_RELAXED) - 1;
+  struct coro_deque_buf *buf = __atomic_load_n (&dq->buf, __ATOMIC_RELAXED);
+  struct coro_task *task = 0;
+  long t;
+
+  __atomic_store_n (&dq->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  t = __atomic_load_n (&dq->top, __ATOMIC_RELAXED);
+
+  if (t <= b)
+    {
+      task = __atomic_load_n (&buf->slot [b & (buf->size - 1)], __ATOMIC_RELAXED);
+
+      if (t == b)
+        {
+          /* the last one, race against the thieves */
+          if (!__atomic_compare_exchange_n (&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = 0;
+
+          __atomic_store_n (&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+  else
+    __atomic_store_n (&dq->bottom, b + 1, __ATOMIC_RELAXED);
+
+  return task;
+}
+
+/* returns 0 if empty, or if another thief was faster */
+static struct coro_task *
+coro_deque_steal (struct coro_deque *dq)
+{
+  long t = __atomic_load_n (&dq->top, __ATOMIC_ACQUIRE);
+  long b;
+
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  b = __atomic_load_n (&dq->bottom, __ATOMIC_ACQUIRE);
+
+  if (t < b)
+    {
+      struct coro_deque_buf *buf = __atomic_load_n (&dq->buf, __ATOMIC_ACQUIRE);
+      struct coro_task *task = __atomic_load_n (&buf->slot [t & (buf->size - 1)], __ATOMIC_RELAXED);
+
+      if (__atomic_compare_exchange_n (&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return task;
+    }
+
+  return 0;
+}
+
+static int
+coro_deque_nonempty (struct coro_deque *dq)
+{
+  return __atomic_load_n (&dq->bottom, __ATOMIC_SEQ_CST) > __atomic_load_n (&dq->top, __ATOMIC_SEQ_CST);
+}
+
+/*****************************************************************************/
+
+/* append to the global queue, used for tasks made ready outside of workers */
+static void
+coro_sched_inject (struct coro_sched *sched, struct coro_task *task)
+{
+  task->next = 0;
+
+  pthread_mutex_lock (&sched->lock);
+
+  if (sched->tail)
+    sched->tail->next = task;
+  else
+    sched->head = task;
+
+  sched->tail = task;
+  __atomic_add_fetch (&sched->queued, 1, __ATOMIC_SEQ_CST);
+
+  if (sched->idle)
+    pthread_cond_signal (&sched->wake);
+
+  pthread_mutex_unlock (&sched->lock);
+}
+
+static struct coro_task *
+coro_sched_dequeue (struct coro_sched *sched)
+{
+  struct coro_task *task;
+
+  if (!__atomic_load_n (&sched->queued, __ATOMIC_RELAXED))
+    return 0;
+
+  pthread_mutex_lock (&sched->lock);
+
+  task = sched->head;
+
+  if (task)
+    {
+      sched->head = task->next;
+
+      if (!sched->head)
+        sched->tail = 0;
+
+      __atomic_sub_fetch (&sched->queued, 1, __ATOMIC_RELAXED);
+    }
+
+  pthread_mutex_unlock (&sched->lock);
+
+  return task;
+}
+
+/* queue a task that just became READY */
+static void
+coro_sched_ready (struct coro_task *task)
+{
+  struct coro_worker *worker = coro_sched_worker_self ();
+  struct coro_sched *sched = task->sched;
+
+  if (worker && worker->sched == sched)
+    {
+      coro_deque_push (&worker->deque, task);
+
+      /* pairs with the idle count increment in coro_sched_sleep */
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+      if (__atomic_load_n (&sched->idle, __ATOMIC_RELAXED))
+        {
+          pthread_mutex_lock (&sched->lock);
+          pthread_cond_signal (&sched->wake);
+          pthread_mutex_unlock (&sched->lock);
+        }
+    }
+  else
+    coro_sched_inject (sched, task);
+}
+
+/* make a PARKED task READY, returns false if it is not parked (yet) */
+static int
+coro_sched_wake_claim (struct coro_task *task)
+{
+  int parked = TASK_PARKED;
+
+  if (!__atomic_compare_exchange_n (&task->state, &parked, TASK_READY, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return 0;
+
+  /* the permit is used up by this wakeup */
+  __atomic_store_n (&task->notified, 0, __ATOMIC_SEQ_CST);
+
+  return 1;
+}
+
+static void
+coro_sched_wake (struct coro_task *task)
+{
+  if (coro_sched_wake_claim (task))
+    coro_sched_ready (task);
+}
+
+/* a task that was switched to directly queues the one it replaced */
+static void
+coro_sched_resumed (void)
+{
+  struct coro_worker *worker = coro_sched_worker_self ();
+  struct coro_task *task = worker->handed;
+
+  if (task)
+    {
+      worker->handed = 0;
+      coro_sched_ready (task);
+    }
+}
+
+static void
+coro_sched_finish (struct coro_task *task)
+{
+  struct coro_sched *sched = task->sched;
+
+  coro_destroy (&task->ctx);
+  coro_stack_free (&task->stack);
+  free (task);
+
+  if (!__atomic_sub_fetch (&sched->ntasks, 1, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock (&sched->lock);
+      pthread_cond_broadcast (&sched->done);
+      pthread_mutex_unlock (&sched->lock);
+    }
+}
+
+static void
+coro_task_start (void *arg)
+{
+  struct coro_task *task = (struct coro_task *)arg;
+
+  task->func (task->arg);
+
+  __atomic_store_n (&task->state, TASK_DONE, __ATOMIC_RELAXED);
+  coro_transfer (&task->ctx, &task->worker->ctx);
+}
+
+/* run task until it switches back to us, then deal with what it wants */
+static void
+coro_sched_switch (struct coro_worker *self, struct coro_task *task)
+{
+  struct coro_task *ran;
+
+  __atomic_store_n (&task->state, TASK_RUNNING, __ATOMIC_RELAXED);
+  self->current = task;
+  task->worker  = self;
+
+  coro_transfer (&self->ctx, &task->ctx);
+
+  /* with coro_sched_handoff, this can be a different task than the one we started */
+  ran = self->current;
+  self->current = 0;
+
+  switch (__atomic_load_n (&ran->state, __ATOMIC_RELAXED))
+    {
+      case TASK_YIELDING:
+        /* our own deque, but see coro_sched_run */
+        coro_sched_ready (ran);
+        self->yielded = 1;
+        break;
+
+      case TASK_PARKING:
+        __atomic_store_n (&ran->state, TASK_PARKED, __ATOMIC_SEQ_CST);
+
+        /* an unpark that came in before the store above is up to us */
+        if (__atomic_load_n (&ran->notified, __ATOMIC_SEQ_CST))
+          coro_sched_wake (ran);
+
+        break;
+
+      case TASK_DONE:
+        coro_sched_finish (ran);
+        break;
+    }
+}
+
+static struct coro_task *
+coro_sched_steal (struct coro_worker *self)
+{
+  struct coro_sched *sched = self->sched;
+  unsigned int i, start;
+
+  if (sched->nworkers < 2)
+    return 0;
+
+  self->seed = self->seed * 1103515245 + 12345;
+  start = (self->seed >> 16) % sched->nworkers;
+
+  for (i = 0; i < sched->nworkers; ++i)
+    {
+      struct coro_worker *victim = sched->workers + (start + i) % sched->nworkers;
+      struct coro_task *task;
+
+      if (victim != self && (task = coro_deque_steal (&victim->deque)))
+        return task;
+    }
+
+  return 0;
+}
+
+static int
+coro_sched_has_work (struct coro_sched *sched)
+{
+  unsigned int i;
+
+  if (__atomic_load_n (&sched->queued, __ATOMIC_SEQ_CST))
+    return 1;
+
+  for (i = 0; i < sched->nworkers; ++i)
+    if (coro_deque_nonempty (&sched->workers [i].deque))
+      return 1;
+
+  return 0;
+}
+
+/* sleep until there might be work, returns true if the worker should exit */
+static int
+coro_sched_sleep (struct coro_worker *self)
+{
+  struct coro_sched *sched = self->sched;
+  int stop;
+
+  pthread_mutex_lock (&sched->lock);
+
+  __atomic_add_fetch (&sched->idle, 1, __ATOMIC_SEQ_CST);
+
+  if (!sched->stop && !coro_sched_has_work (sched))
+    pthread_cond_wait (&sched->wake, &sched->lock);
+
+  __atomic_sub_fetch (&sched->idle, 1, __ATOMIC_SEQ_CST);
+  stop = sched->stop;
+
+  pthread_mutex_unlock (&sched->lock);
+
+  return stop;
+}
+
+static void *
+coro_sched_run (void *arg)
+{
+  struct coro_worker *self = (struct coro_worker *)arg;
+  struct coro_sched *sched = self->sched;
+  unsigned long tick = 0;
+
+  coro_sched_worker = self;
+  coro_create (&self->ctx, 0, 0, 0, 0);
+
+  for (;;)
+    {
+      struct coro_task *task = 0;
+
+      /* look at the global queue first now and then, so it cannot starve */
+      if (!(++tick % 61))
+        task = coro_sched_dequeue (sched);
+
+      /*
+       * A yielding task went to the bottom, so take the oldest one from the
+       * top, or yields would just run the same task again.
+       */
+      if (!task && self->yielded)
+        task = coro_deque_steal (&self->deque);
+
+      self->yielded = 0;
+
+      if (!task)
+        task = coro_deque_take (&self->deque);
+
+      if (!task)
+        task = coro_sched_dequeue (sched);
+
+      if (!task)
+        task = coro_sched_steal (self);
+
+      if (task)
+        coro_sched_switch (self, task);
+      else if (coro_sched_sleep (self))
+        break;
+    }
+
+  coro_destroy (&self->ctx);
+
+  return 0;
+}
+
+/*****************************************************************************/
+
+static void
+coro_sched_stop (struct coro_sched *sched, unsigned int nstarted)
+{
+  unsigned int i;
+
+  pthread_mutex_lock (&sched->lock);
+  sched->stop = 1;
+  pthread_cond_broadcast (&sched->wake);
+  pthread_mutex_unlock (&sched->lock);
+
+  for (i = 0; i < nstarted; ++i)
+    pthread_join (sched->workers [i].thread, 0);
+
+  for (i = 0; i < sched->nworkers; ++i)
+    coro_deque_destroy (&sched->workers [i].deque);
+
+  pthread_cond_destroy (&sched->done);
+  pthread_cond_destroy (&sched->wake);
+  pthread_mutex_destroy (&sched->lock);
+
+  free (sched->workers);
+  free (sched);
+}
+
+struct coro_sched *
+coro_sched_new (unsigned int nworkers)
+{
+  struct coro_sched *sched;
+  unsigned int i;
+
+  if (!nworkers)
+    {
+      long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+
+      nworkers = ncpu > 0 ? ncpu : 1;
+    }
+
+  sched = (struct coro_sched *)calloc (1, sizeof (struct coro_sched));
+
+  if (!sched)
+    return 0;
+
+  /* calloc does not honour the alignment, but it is only a performance hint */
+  sched->workers = (struct coro_worker *)calloc (nworkers, sizeof (struct coro_worker));
+
+  if (!sched->workers)
+    {
+      free (sched);
+      return 0;
+    }
+
+  sched->nworkers = nworkers;
+  pthread_mutex_init (&sched->lock, 0);
+  pthread_cond_init (&sched->wake, 0);
+  pthread_cond_init (&sched->done, 0);
+
+  for (i = 0; i < nworkers; ++i)
+    {
+      coro_deque_init (&sched->workers [i].deque);
+      sched->workers [i].sched = sched;
+      sched->workers [i].seed  = i + 1;
+    }
+
+  for (i = 0; i < nworkers; ++i)
+    if (pthread_create (&sched->workers [i].thread, 0, coro_sched_run, sched->workers + i))
+      {
+        coro_sched_stop (sched, i);
+        return 0;
+      }
+
+  return sched;
+}
+
+void
+coro_sched_free (struct coro_sched *sched)
+{
+  coro_sched_wait (sched);
+  coro_sched_stop (sched, sched->nworkers);
+}
+
+int
+coro_sched_spawn (struct coro_sched *sched, coro_func func, void *arg, unsigned int size)
+{
+  struct coro_task *task = (struct coro_task *)malloc (sizeof (struct coro_task));
+
+  if (!task)
+    return 0;
+
+  if (!coro_stack_alloc (&task->stack, size))
+    {
+      free (task);
+      return 0;
+    }
+
+  task->func     = func;
+  task->arg      = arg;
+  task->sched    = sched;
+  task->state    = TASK_READY;
+  task->notified = 0;
+
+#if !CORO_ASM
+  pthread_mutex_lock (&coro_sched_create_lock);
+#endif
+  coro_create (&task->ctx, coro_task_start, task, task->stack.sptr, task->stack.ssze);
+#if !CORO_ASM
+  pthread_mutex_unlock (&coro_sched_create_lock);
+#endif
+
+  __atomic_add_fetch (&sched->ntasks, 1, __ATOMIC_SEQ_CST);
+  coro_sched_ready (task);
+
+  return 1;
+}
+
+void
+coro_sched_wait (struct coro_sched *sched)
+{
+  pthread_mutex_lock (&sched->lock);
+
+  while (__atomic_load_n (&sched->ntasks, __ATOMIC_SEQ_CST))
+    pthread_cond_wait (&sched->done, &sched->lock);
+
+  pthread_mutex_unlock (&sched->lock);
+}
+
+struct coro_task *
+coro_sched_self (void)
+{
+  return coro_sched_current ();
+}
+
+void
+coro_sched_yield (void)
+{
+  struct coro_task *task = coro_sched_task ();
+
+  __atomic_store_n (&task->state, TASK_YIELDING, __ATOMIC_RELAXED);
+  coro_transfer (&task->ctx, &task->worker->ctx);
+  coro_sched_resumed ();
+}
+
+void
+coro_sched_park (void)
+{
+  struct coro_task *task = coro_sched_task ();
+
+  if (__atomic_exchange_n (&task->notified, 0, __ATOMIC_SEQ_CST))
+    return;
+
+  __atomic_store_n (&task->state, TASK_PARKING, __ATOMIC_RELAXED);
+  coro_transfer (&task->ctx, &task->worker->ctx);
+  coro_sched_resumed ();
+}
+
+void
+coro_sched_unpark (struct coro_task *task)
+{
+  if (!__atomic_exchange_n (&task->notified, 1, __ATOMIC_SEQ_CST))
+    coro_sched_wake (task);
+}
+
+int
+coro_sched_claim (struct coro_task *task)
+{
+  return !__atomic_exchange_n (&task->notified, 1, __ATOMIC_SEQ_CST)
+         && coro_sched_wake_claim (task);
+}
+
+void
+coro_sched_handoff (struct coro_task *task)
+{
+  struct coro_task *self = coro_sched_current ();
+  struct coro_worker *worker;
+
+  if (!self || self->sched != task->sched)
+    {
+      coro_sched_ready (task);
+      return;
+    }
+
+  /* self is queued by task once we are off our stack, see coro_sched_resumed */
+  worker = self->worker;
+  __atomic_store_n (&self->state, TASK_READY, __ATOMIC_RELAXED);
+  worker->handed = self;
+
+  __atomic_store_n (&task->state, TASK_RUNNING, __ATOMIC_RELAXED);
+  worker->current = task;
+  task->worker    = worker;
+
+  coro_transfer (&self->ctx, &task->ctx);
+  coro_sched_resumed ();
+}
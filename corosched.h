@@ -0,0 +1,108 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+/*
+ * An optional M:N scheduler on top of coro_transfer: tasks (coroutines
+ * with their own stack) are run by one worker thread per core, each of
+ * which keeps its ready tasks in a Chase-Lev work-stealing deque. Idle
+ * workers steal from the others, or sleep.
+ *
+ * Tasks move between threads, so the backend must support resuming a
+ * coro_context on a different thread than the one it was suspended on.
+ * CORO_FIBER does not, and CORO_PTHREAD cannot be used either, as its
+ * threads outlive coro_destroy. Task code must not keep pointers to
+ * thread-local variables across coro_sched_yield/coro_sched_park.
+ *
+ * Build with -Dsched=true to include it in the library.
+ */
+
+#ifndef COROSCHED_H
+#define COROSCHED_H
+
+#include "coro.h"
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct coro_sched;
+struct coro_task;
+
+/*
+ * Create a scheduler and start its worker threads, one per online cpu if
+ * nworkers is 0. Returns 0 on failure.
+ */
+struct coro_sched *coro_sched_new (unsigned int nworkers);
+
+/*
+ * Wait until all tasks have finished, then stop the workers and free the
+ * scheduler.
+ */
+void coro_sched_free (struct coro_sched *sched);
+
+/*
+ * Start a new task running func (arg) on a stack of the given size (as
+ * for coro_stack_alloc). The task's memory is released when func
+ * returns. Can be called from any thread, including from tasks. Returns
+ * false if the stack could not be allocated.
+ */
+int coro_sched_spawn (struct coro_sched *sched, coro_func func, void *arg, unsigned int size);
+
+/*
+ * Block the calling thread until there are no more tasks. Must not be
+ * called from a task.
+ */
+void coro_sched_wait (struct coro_sched *sched);
+
+/*
+ * The task running on the calling thread, or 0 outside of tasks.
+ */
+struct coro_task *coro_sched_self (void);
+
+/*
+ * Let other tasks run. The calling task is put on its worker's own
+ * deque, behind the tasks already there, where idle workers can steal
+ * it. Must be called from a task.
+ */
+void coro_sched_yield (void);
+
+/*
+ * Suspend the calling task until coro_sched_unpark is called on it. If
+ * that already happened since the task last returned from
+ * coro_sched_park, return immediately. Like with condition variables,
+ * callers should re-check their wakeup condition. Must be called from a
+ * task.
+ */
+void coro_sched_park (void);
+
+/*
+ * Make a parked task runnable again, or make its next coro_sched_park
+ * return immediately if it is not parked. Can be called from any thread.
+ */
+void coro_sched_unpark (struct coro_task *task);
+
+/*
+ * Like coro_sched_unpark, except that if task is parked, it is not
+ * queued, but handed to the caller, who must pass it to
+ * coro_sched_handoff. Returns true in that case, false if task was only
+ * unparked. The point is that this can be done while holding a lock
+ * the task needs to get going again, and the switch after releasing it.
+ */
+int coro_sched_claim (struct coro_task *task);
+
+/*
+ * Switch straight to task, which the caller got from coro_sched_claim,
+ * without going through the scheduler. The calling task is queued on its
+ * worker's own deque like with coro_sched_yield, but not behind the
+ * others, so it usually runs again right after task. Outside of tasks of
+ * the same scheduler, this just queues task.
+ */
+void coro_sched_handoff (struct coro_task *task);
+
+#if __cplusplus
+}
+#endif
+
+#endif
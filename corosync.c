@@ -0,0 +1,410 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+#include "corosync.h"
+
+/*
+ * A task that has to wait puts a waiter on its stack into the queue of
+ * the primitive and parks until the waiter is marked woken, at which
+ * point it owns what it waited for. Waking happens under the queue's
+ * lock, and the woken task takes that lock once more before it returns,
+ * so neither its waiter nor the task itself go away while the waker
+ * still looks at them.
+ *
+ * A condition variable's waiter is requeued to the mutex on a signal,
+ * so it is woken by (and synchronises with) the mutex's queue.
+ */
+struct coro_waiter
+{
+  struct coro_waiter *next;
+  struct coro_task *task;
+  struct coro_mutex *mutex; /* the one given to coro_cond_wait */
+  int woken;
+};
+
+static void
+coro_waitq_init (struct coro_waitq *q)
+{
+  pthread_mutex_init (&q->lock, 0);
+  q->head = 0;
+  q->tail = &q->head;
+}
+
+static void
+coro_waitq_destroy (struct coro_waitq *q)
+{
+  pthread_mutex_destroy (&q->lock);
+}
+
+/* called with the lock held */
+static void
+coro_waitq_push (struct coro_waitq *q, struct coro_waiter *w)
+{
+  w->next = 0;
+  *q->tail = w;
+  q->tail = &w->next;
+}
+
+/* called with the lock held */
+static struct coro_waiter *
+coro_waitq_pop (struct coro_waitq *q)
+{
+  struct coro_waiter *w = q->head;
+
+  if (w && !(q->head = w->next))
+    q->tail = &q->head;
+
+  return w;
+}
+
+static void
+coro_waiter_init (struct coro_waiter *w, struct coro_mutex *mutex)
+{
+  w->task  = coro_sched_self ();
+  w->mutex = mutex;
+  w->woken = 0;
+}
+
+/*
+ * Mark w as woken and unpark its task. With claim set, a parked task is
+ * returned instead, for the caller to coro_sched_handoff to once it has
+ * released the lock, which it must hold when calling this.
+ */
+static struct coro_task *
+coro_waiter_wake (struct coro_waiter *w, int claim)
+{
+  struct coro_task *task = w->task;
+
+  __atomic_store_n (&w->woken, 1, __ATOMIC_RELEASE);
+
+  if (claim)
+    return coro_sched_claim (task) ? task : 0;
+
+  coro_sched_unpark (task);
+  return 0;
+}
+
+/* park until w is woken, lock is that of the queue it is woken from */
+static void
+coro_waiter_sleep (struct coro_waiter *w, pthread_mutex_t *lock)
+{
+  while (!__atomic_load_n (&w->woken, __ATOMIC_ACQUIRE))
+    coro_sched_park ();
+
+  pthread_mutex_lock (lock);
+  pthread_mutex_unlock (lock);
+}
+
+/*****************************************************************************/
+
+void
+coro_mutex_init (struct coro_mutex *mutex)
+{
+  mutex->state = 0;
+  coro_waitq_init (&mutex->q);
+}
+
+void
+coro_mutex_destroy (struct coro_mutex *mutex)
+{
+  coro_waitq_destroy (&mutex->q);
+}
+
+/*
+ * Take the mutex for w if it is unlocked (returns true), or queue w and
+ * mark the mutex as having waiters. Called with the queue lock held.
+ */
+static int
+coro_mutex_enqueue (struct coro_mutex *mutex, struct coro_waiter *w)
+{
+  int state = __atomic_load_n (&mutex->state, __ATOMIC_RELAXED);
+
+  while (state != 2)
+    if (__atomic_compare_exchange_n (&mutex->state, &state, state + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+        if (!state)
+          return 1;
+
+        break;
+      }
+
+  coro_waitq_push (&mutex->q, w);
+
+  return 0;
+}
+
+int
+coro_mutex_trylock (struct coro_mutex *mutex)
+{
+  int unlocked = 0;
+
+  return __atomic_compare_exchange_n (&mutex->state, &unlocked, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void
+coro_mutex_lock (struct coro_mutex *mutex)
+{
+  struct coro_waiter w;
+
+  if (coro_mutex_trylock (mutex))
+    return;
+
+  coro_waiter_init (&w, 0);
+
+  pthread_mutex_lock (&mutex->q.lock);
+
+  if (coro_mutex_enqueue (mutex, &w))
+    {
+      pthread_mutex_unlock (&mutex->q.lock);
+      return;
+    }
+
+  pthread_mutex_unlock (&mutex->q.lock);
+
+  coro_waiter_sleep (&w, &mutex->q.lock);
+}
+
+void
+coro_mutex_unlock (struct coro_mutex *mutex)
+{
+  struct coro_task *task;
+  int locked = 1;
+
+  if (__atomic_compare_exchange_n (&mutex->state, &locked, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    return;
+
+  /* there are waiters, so the mutex stays locked and goes to the first */
+  pthread_mutex_lock (&mutex->q.lock);
+
+  task = coro_waiter_wake (coro_waitq_pop (&mutex->q), 1);
+
+  if (!mutex->q.head)
+    __atomic_store_n (&mutex->state, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock (&mutex->q.lock);
+
+  if (task)
+    coro_sched_handoff (task);
+}
+
+/*****************************************************************************/
+
+void
+coro_cond_init (struct coro_cond *cond)
+{
+  coro_waitq_init (&cond->q);
+}
+
+void
+coro_cond_destroy (struct coro_cond *cond)
+{
+  coro_waitq_destroy (&cond->q);
+}
+
+void
+coro_cond_wait (struct coro_cond *cond, struct coro_mutex *mutex)
+{
+  struct coro_waiter w;
+
+  coro_waiter_init (&w, mutex);
+
+  pthread_mutex_lock (&cond->q.lock);
+  coro_waitq_push (&cond->q, &w);
+  pthread_mutex_unlock (&cond->q.lock);
+
+  coro_mutex_unlock (mutex);
+
+  /* we hold the mutex again once woken */
+  coro_waiter_sleep (&w, &mutex->q.lock);
+}
+
+/*
+ * Move up to n waiters from the condition variable to their mutex,
+ * returning the task that got the mutex right away, if it needs a
+ * handoff. At most one can.
+ */
+static struct coro_task *
+coro_cond_requeue (struct coro_cond *cond, unsigned int n)
+{
+  struct coro_task *task = 0;
+  struct coro_waiter *w;
+
+  while (n-- && (w = coro_waitq_pop (&cond->q)))
+    {
+      struct coro_mutex *mutex = w->mutex;
+
+      pthread_mutex_lock (&mutex->q.lock);
+
+      if (coro_mutex_enqueue (mutex, w))
+        task = coro_waiter_wake (w, 1);
+
+      pthread_mutex_unlock (&mutex->q.lock);
+    }
+
+  return task;
+}
+
+void
+coro_cond_signal (struct coro_cond *cond)
+{
+  struct coro_task *task;
+
+  pthread_mutex_lock (&cond->q.lock);
+  task = coro_cond_requeue (cond, 1);
+  pthread_mutex_unlock (&cond->q.lock);
+
+  if (task)
+    coro_sched_handoff (task);
+}
+
+void
+coro_cond_broadcast (struct coro_cond *cond)
+{
+  struct coro_task *task;
+
+  pthread_mutex_lock (&cond->q.lock);
+  task = coro_cond_requeue (cond, ~0U);
+  pthread_mutex_unlock (&cond->q.lock);
+
+  if (task)
+    coro_sched_handoff (task);
+}
+
+/*****************************************************************************/
+
+void
+coro_sem_init (struct coro_sem *sem, unsigned int value)
+{
+  sem->value   = value;
+  sem->wakeups = 0;
+  coro_waitq_init (&sem->q);
+}
+
+void
+coro_sem_destroy (struct coro_sem *sem)
+{
+  coro_waitq_destroy (&sem->q);
+}
+
+int
+coro_sem_trywait (struct coro_sem *sem)
+{
+  long value = __atomic_load_n (&sem->value, __ATOMIC_RELAXED);
+
+  while (value > 0)
+    if (__atomic_compare_exchange_n (&sem->value, &value, value - 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 1;
+
+  return 0;
+}
+
+void
+coro_sem_wait (struct coro_sem *sem)
+{
+  struct coro_waiter w;
+
+  if (__atomic_fetch_sub (&sem->value, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  /* we are counted as a waiter now, a post might have come before we got queued */
+  pthread_mutex_lock (&sem->q.lock);
+
+  if (sem->wakeups)
+    {
+      --sem->wakeups;
+      pthread_mutex_unlock (&sem->q.lock);
+      return;
+    }
+
+  coro_waiter_init (&w, 0);
+  coro_waitq_push (&sem->q, &w);
+
+  pthread_mutex_unlock (&sem->q.lock);
+
+  coro_waiter_sleep (&w, &sem->q.lock);
+}
+
+void
+coro_sem_post (struct coro_sem *sem)
+{
+  struct coro_task *task = 0;
+  struct coro_waiter *w;
+
+  if (__atomic_fetch_add (&sem->value, 1, __ATOMIC_ACQ_REL) >= 0)
+    return;
+
+  pthread_mutex_lock (&sem->q.lock);
+
+  if ((w = coro_waitq_pop (&sem->q)))
+    task = coro_waiter_wake (w, 1);
+  else
+    ++sem->wakeups;
+
+  pthread_mutex_unlock (&sem->q.lock);
+
+  if (task)
+    coro_sched_handoff (task);
+}
+
+/*****************************************************************************/
+
+void
+coro_wait_group_init (struct coro_wait_group *wg)
+{
+  wg->count = 0;
+  coro_waitq_init (&wg->q);
+}
+
+void
+coro_wait_group_destroy (struct coro_wait_group *wg)
+{
+  coro_waitq_destroy (&wg->q);
+}
+
+void
+coro_wait_group_add (struct coro_wait_group *wg, int n)
+{
+  struct coro_waiter *w;
+
+  if (__atomic_add_fetch (&wg->count, n, __ATOMIC_ACQ_REL))
+    return;
+
+  pthread_mutex_lock (&wg->q.lock);
+
+  while ((w = coro_waitq_pop (&wg->q)))
+    coro_waiter_wake (w, 0);
+
+  pthread_mutex_unlock (&wg->q.lock);
+}
+
+void
+coro_wait_group_done (struct coro_wait_group *wg)
+{
+  coro_wait_group_add (wg, -1);
+}
+
+void
+coro_wait_group_wait (struct coro_wait_group *wg)
+{
+  struct coro_waiter w;
+
+  if (!__atomic_load_n (&wg->count, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock (&wg->q.lock);
+
+  if (!__atomic_load_n (&wg->count, __ATOMIC_ACQUIRE))
+    {
+      pthread_mutex_unlock (&wg->q.lock);
+      return;
+    }
+
+  coro_waiter_init (&w, 0);
+  coro_waitq_push (&wg->q, &w);
+
+  pthread_mutex_unlock (&wg->q.lock);
+
+  coro_waiter_sleep (&w, &wg->q.lock);
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+/*
+ * Mutexes, condition variables, semaphores and wait groups for the tasks
+ * of the scheduler in corosched.h. Unlike their pthread counterparts,
+ * they block only the calling task, not the worker thread running it and
+ * every other task queued there.
+ *
+ * Taking a free mutex, posting a semaphore nobody waits on and the like
+ * is a single atomic operation. Tasks that have to wait are queued in
+ * the primitive itself, in a list of waiters on their own stacks, and
+ * woken in FIFO order. What they waited for is handed to them directly
+ * (a mutex is unlocked into the hands of the first waiter, a semaphore
+ * post goes to the first waiter), so late comers cannot overtake them,
+ * and the waker switches to the woken task right away (see
+ * coro_sched_handoff). Waiters may run on any worker thread.
+ *
+ * The functions that wait must be called from tasks, the others can
+ * also be called from other threads. The structures must be initialised
+ * with their init function and must not be copied; their members are
+ * private.
+ *
+ * Built together with the scheduler (-Dsched=true).
+ */
+
+#ifndef COROSYNC_H
+#define COROSYNC_H
+
+#include "corosched.h"
+
+#include <pthread.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct coro_waiter;
+
+struct coro_waitq
+{
+  pthread_mutex_t lock; /* only held for queue operations */
+  struct coro_waiter *head, **tail;
+};
+
+struct coro_mutex
+{
+  int state; /* 0 unlocked, 1 locked, 2 locked with waiters */
+  struct coro_waitq q;
+};
+
+struct coro_cond
+{
+  struct coro_waitq q;
+};
+
+struct coro_sem
+{
+  long value; /* negative: minus the number of waiting tasks */
+  unsigned long wakeups; /* posts for tasks about to queue */
+  struct coro_waitq q;
+};
+
+struct coro_wait_group
+{
+  long count;
+  struct coro_waitq q;
+};
+
+/*
+ * A mutex that the holding task can keep across coro_sched_yield and
+ * friends. Not recursive.
+ */
+void coro_mutex_init (struct coro_mutex *mutex);
+void coro_mutex_destroy (struct coro_mutex *mutex);
+void coro_mutex_lock (struct coro_mutex *mutex);
+/* returns false instead of waiting */
+int coro_mutex_trylock (struct coro_mutex *mutex);
+void coro_mutex_unlock (struct coro_mutex *mutex);
+
+/*
+ * A condition variable. All waiters must use the same mutex. Signalled
+ * waiters are not woken, but moved over to the queue of the mutex, so
+ * a broadcast does not wake a crowd of tasks only to have all but one
+ * wait for the mutex again. Spurious wakeups do not happen, but as
+ * usual, waiters should re-check their condition anyway.
+ */
+void coro_cond_init (struct coro_cond *cond);
+void coro_cond_destroy (struct coro_cond *cond);
+void coro_cond_wait (struct coro_cond *cond, struct coro_mutex *mutex);
+void coro_cond_signal (struct coro_cond *cond);
+void coro_cond_broadcast (struct coro_cond *cond);
+
+/*
+ * A counting semaphore.
+ */
+void coro_sem_init (struct coro_sem *sem, unsigned int value);
+void coro_sem_destroy (struct coro_sem *sem);
+void coro_sem_wait (struct coro_sem *sem);
+/* returns false instead of waiting */
+int coro_sem_trywait (struct coro_sem *sem);
+void coro_sem_post (struct coro_sem *sem);
+
+/*
+ * A counter of outstanding work: coro_wait_group_add adds n (usually
+ * before starting n tasks), coro_wait_group_done subtracts one, and
+ * coro_wait_group_wait waits until the counter is zero. The counter
+ * must not go below zero, and must not be raised from zero again until
+ * all waiters have returned.
+ */
+void coro_wait_group_init (struct coro_wait_group *wg);
+void coro_wait_group_destroy (struct coro_wait_group *wg);
+void coro_wait_group_add (struct coro_wait_group *wg, int n);
+void coro_wait_group_done (struct coro_wait_group *wg);
+void coro_wait_group_wait (struct coro_wait_group *wg);
+
+#if __cplusplus
+}
+#endif
+
+#endif
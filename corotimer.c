@@ -0,0 +1,213 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+#include "corotimer.h"
+
+#include <string.h>
+
+/*
+ * A timer that expires later than now goes into the wheel of the
+ * highest bit group in which expire and now differ, into the slot given
+ * by expire's bits in that group. All bits above are the same as now's,
+ * and the slot is always ahead of now's in that wheel, so the timer
+ * needs looking at exactly when now enters that slot. This is the
+ * scheme used in William Ahern's timeout.c.
+ */
+static void
+coro_wheel_insert (struct coro_wheel *w, struct coro_timer *t)
+{
+  struct coro_timer **head;
+
+  if (t->expire <= w->now)
+    {
+      head = &w->expired;
+      t->slot = -1;
+    }
+  else
+    {
+      int level = (63 - __builtin_clzll (t->expire ^ w->now)) / CORO_WHEEL_BITS;
+      int slot = (t->expire >> (level * CORO_WHEEL_BITS)) & (CORO_WHEEL_SLOTS - 1);
+
+      w->pending [level] |= (uint64_t)1 << slot;
+      t->slot = level * CORO_WHEEL_SLOTS + slot;
+      head = w->slot + t->slot;
+    }
+
+  t->next = *head;
+  if (t->next)
+    t->next->prev = &t->next;
+  t->prev = head;
+  *head = t;
+}
+
+static void
+coro_wheel_unlink (struct coro_wheel *w, struct coro_timer *t)
+{
+  *t->prev = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  t->prev = 0;
+
+  if (t->slot >= 0 && !w->slot [t->slot])
+    w->pending [t->slot / CORO_WHEEL_SLOTS] &= ~((uint64_t)1 << (t->slot % CORO_WHEEL_SLOTS));
+}
+
+void
+coro_wheel_init (struct coro_wheel *w, uint64_t now)
+{
+  memset (w, 0, sizeof (*w));
+  w->now = now;
+}
+
+void
+coro_timer_arm (struct coro_wheel *w, struct coro_timer *t, uint64_t expire)
+{
+  if (t->prev)
+    coro_wheel_unlink (w, t);
+
+  t->expire = expire;
+  coro_wheel_insert (w, t);
+}
+
+void
+coro_timer_cancel (struct coro_wheel *w, struct coro_timer *t)
+{
+  if (t->prev)
+    coro_wheel_unlink (w, t);
+}
+
+void
+coro_wheel_advance (struct coro_wheel *w, uint64_t now)
+{
+  struct coro_timer *todo = 0;
+  int level;
+
+  if (now <= w->now)
+    return;
+
+  /* collect the slots that now passes, wheel by wheel */
+  for (level = 0; level < CORO_WHEEL_LEVELS; ++level)
+    {
+      int shift = level * CORO_WHEEL_BITS;
+      uint64_t elapsed = (now >> shift) - (w->now >> shift);
+      uint64_t passed;
+
+      if (!elapsed)
+        break;
+
+      if (elapsed >= CORO_WHEEL_SLOTS)
+        passed = ~(uint64_t)0;
+      else
+        {
+          /* the elapsed slots following now's, wrapping around */
+          int start = ((w->now >> shift) + 1) & (CORO_WHEEL_SLOTS - 1);
+
+          passed = ((uint64_t)1 << elapsed) - 1;
+          passed = start ? passed << start | passed >> (64 - start) : passed;
+        }
+
+      passed &= w->pending [level];
+      w->pending [level] &= ~passed;
+
+      while (passed)
+        {
+          struct coro_timer **head = w->slot + level * CORO_WHEEL_SLOTS + __builtin_ctzll (passed);
+          struct coro_timer *t;
+
+          while ((t = *head))
+            {
+              *head = t->next;
+              t->next = todo;
+              todo = t;
+            }
+
+          passed &= passed - 1;
+        }
+    }
+
+  w->now = now;
+
+  /* expire them, or move them further in */
+  while (todo)
+    {
+      struct coro_timer *t = todo;
+
+      todo = t->next;
+      coro_wheel_insert (w, t);
+    }
+}
+
+struct coro_timer *
+coro_wheel_expired (struct coro_wheel *w)
+{
+  struct coro_timer *t = w->expired;
+
+  if (t)
+    coro_wheel_unlink (w, t);
+
+  return t;
+}
+
+unsigned int
+coro_wheel_run (struct coro_wheel *w, uint64_t now, coro_context *self)
+{
+  struct coro_timer *t;
+  /* coro_transfer can be setjmp */
+  volatile unsigned int count = 0;
+
+  coro_wheel_advance (w, now);
+
+  while ((t = coro_wheel_expired (w)))
+    {
+      ++count;
+      coro_transfer (self, t->ctx);
+    }
+
+  return count;
+}
+
+uint64_t
+coro_wheel_timeout (struct coro_wheel *w)
+{
+  int level;
+
+  if (w->expired)
+    return 0;
+
+  /* the innermost non-empty wheel always has the earliest timer */
+  for (level = 0; level < CORO_WHEEL_LEVELS; ++level)
+    if (w->pending [level])
+      {
+        int shift = level * CORO_WHEEL_BITS;
+        uint64_t base = w->now >> shift;
+        /* the slots ahead of now's are the only ones in use */
+        uint64_t ahead = w->pending [level] >> (base & (CORO_WHEEL_SLOTS - 1));
+        uint64_t when = (base + __builtin_ctzll (ahead)) << shift;
+
+        /* when is the first tick of the slot, which is after now */
+        return when - w->now;
+      }
+
+  return UINT64_MAX;
+}
+
+int
+coro_wheel_sleep (struct coro_wheel *w, uint64_t expire, coro_context *self, coro_context *loop)
+{
+  struct coro_timer t;
+
+  t.prev = 0;
+  t.ctx  = self;
+  coro_timer_arm (w, &t, expire);
+
+  coro_transfer (self, loop);
+
+  if (!t.prev)
+    return 1;
+
+  coro_timer_cancel (w, &t);
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+/*
+ * A hierarchical timer wheel, for sleeping coroutines and timeouts.
+ *
+ * Time is measured in ticks, whatever unit the caller chooses, and only
+ * moves forward when the caller says so (coro_wheel_advance or
+ * coro_wheel_run). Timers are kept in eleven wheels of 64 slots each,
+ * the first one one tick per slot, the next 64 ticks per slot and so
+ * on, so arming and cancelling a timer is O(1), no matter how many are
+ * pending. When time passes a slot in an outer wheel, its timers move
+ * to the inner wheels, each timer at most ten times during its life.
+ *
+ * The usual loop asks coro_wheel_timeout how long its poller may block,
+ * polls, then calls coro_wheel_run, which coro_transfer's to each
+ * coroutine whose timer expired, in one batch. Loops that do not resume
+ * with coro_transfer (e.g. the reactors in corouring.h and coroepoll.h)
+ * use coro_wheel_advance and coro_wheel_expired instead.
+ *
+ * The wheel does no locking, it and its timers belong to one thread.
+ * The timer structures are owned by the caller, and usually live in the
+ * sleeping coroutine's stack frame.
+ */
+
+#ifndef COROTIMER_H
+#define COROTIMER_H
+
+#include "coro.h"
+
+#include <stdint.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+#define CORO_WHEEL_BITS   6
+#define CORO_WHEEL_SLOTS  (1 << CORO_WHEEL_BITS)
+#define CORO_WHEEL_LEVELS ((64 + CORO_WHEEL_BITS - 1) / CORO_WHEEL_BITS)
+
+struct coro_timer
+{
+  struct coro_timer *next, **prev; /* prev is 0 when the timer is not armed */
+  uint64_t expire;
+  int slot; /* index into slot, or -1 when expired */
+  coro_context *ctx; /* what coro_wheel_run resumes */
+  void *data; /* for the caller */
+};
+
+struct coro_wheel
+{
+  uint64_t now;
+  uint64_t pending [CORO_WHEEL_LEVELS]; /* a bit for each non-empty slot */
+  struct coro_timer *expired;
+  struct coro_timer *slot [CORO_WHEEL_LEVELS * CORO_WHEEL_SLOTS];
+};
+
+/*
+ * Initialise an empty wheel whose time is now.
+ */
+void coro_wheel_init (struct coro_wheel *w, uint64_t now);
+
+/*
+ * Arm (or re-arm) timer t to expire at tick expire. t->ctx and t->data
+ * are left alone. A timer for now or earlier expires with the next
+ * coro_wheel_advance/coro_wheel_run.
+ */
+void coro_timer_arm (struct coro_wheel *w, struct coro_timer *t, uint64_t expire);
+
+/*
+ * Disarm t, if it is armed, also if it has expired but not been
+ * collected yet.
+ */
+void coro_timer_cancel (struct coro_wheel *w, struct coro_timer *t);
+
+/*
+ * Whether t is armed, i.e. neither cancelled nor collected since its
+ * last coro_timer_arm.
+ */
+#define coro_timer_armed(t) ((t)->prev != 0)
+
+/*
+ * Set the wheel's time to now (if it is later than the current one),
+ * and move all timers that expire at or before it to the expired list.
+ */
+void coro_wheel_advance (struct coro_wheel *w, uint64_t now);
+
+/*
+ * Remove one timer from the expired list and return it, or 0 if the
+ * list is empty.
+ */
+struct coro_timer *coro_wheel_expired (struct coro_wheel *w);
+
+/*
+ * Advance to now, then coro_transfer from self to the ctx of every
+ * expired timer, one after the other. The coroutines are expected to
+ * transfer back to self sooner or later, and may arm and cancel timers
+ * meanwhile. Timers armed for now or earlier while this runs are
+ * expired in the same batch. Returns the number of timers that expired.
+ */
+unsigned int coro_wheel_run (struct coro_wheel *w, uint64_t now, coro_context *self);
+
+/*
+ * The number of ticks a poller may block before the next call to
+ * coro_wheel_advance/coro_wheel_run is due, 0 if there are expired
+ * timers, or UINT64_MAX if no timer is armed. For timers further out
+ * than 64 ticks, this is when they need to move to an inner wheel, so
+ * it can be earlier than the actual expiry.
+ */
+uint64_t coro_wheel_timeout (struct coro_wheel *w);
+
+/*
+ * Suspend the coroutine running in self by transferring to loop, until
+ * coro_wheel_run resumes it at (or after) tick expire. If something
+ * else transfers to self first, the timer is cancelled. Returns whether
+ * the timer expired.
+ */
+int coro_wheel_sleep (struct coro_wheel *w, uint64_t expire, coro_context *self, coro_context *loop);
+
+#if __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,452 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+#include "corouring.h"
+#include "corotimer.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if !CORO_STACKALLOC
+# error corouring needs the stack management functions (CORO_STACKALLOC)
+#endif
+
+#if !CORO_ASYM
+# error corouring needs the asymmetric coroutines (CORO_ASYM)
+#endif
+
+struct coro_uring_task
+{
+  coro_asym co; /* must be first, coro_asym_current () is the task */
+  struct coro_stack stack;
+  coro_func func;
+  void *arg;
+  struct coro_uring_task *next; /* run queue link */
+};
+
+struct coro_uring
+{
+  int fd;
+
+  /* submission queue, the kernel owns everything between head and tail */
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int sqe_tail; /* our tail, published on io_uring_enter */
+  struct io_uring_sqe *sqes;
+
+  /* completion queue, we own everything between head and tail */
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring; /* == sq_ring with IORING_FEAT_SINGLE_MMAP */
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  unsigned int pending; /* sqes not yet submitted */
+  unsigned int ntasks;
+  unsigned int features;
+  struct coro_uring_task *runq, **runq_tail;
+  struct coro_wheel wheel; /* sleeping tasks, in milliseconds */
+};
+
+static uint64_t
+coro_uring_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct coro_uring *
+coro_uring_new (unsigned int entries)
+{
+  struct io_uring_params p;
+  struct coro_uring *ring = (struct coro_uring *)calloc (1, sizeof (struct coro_uring));
+  unsigned int *array;
+  unsigned int i;
+  int err;
+
+  if (!ring)
+    return 0;
+
+  memset (&p, 0, sizeof (p));
+  ring->fd = syscall (__NR_io_uring_setup, entries ? entries : 256, &p);
+
+  if (ring->fd < 0)
+    {
+      free (ring);
+      return 0;
+    }
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+
+      ring->cq_ring_size = 0;
+    }
+
+  ring->sq_ring = mmap (0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto fail_sq;
+
+  if (ring->cq_ring_size)
+    {
+      ring->cq_ring = mmap (0, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+        goto fail_cq;
+    }
+  else
+    ring->cq_ring = ring->sq_ring;
+
+  ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap (0, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail_sqes;
+
+  ring->sq_head    = (unsigned int *)((char *)ring->sq_ring + p.sq_off.head);
+  ring->sq_tail    = (unsigned int *)((char *)ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask    = *(unsigned int *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sqe_tail   = *ring->sq_tail;
+
+  ring->cq_head    = (unsigned int *)((char *)ring->cq_ring + p.cq_off.head);
+  ring->cq_tail    = (unsigned int *)((char *)ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask    = *(unsigned int *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes       = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+
+  /* sqes are used in ring order, so the indirection array never changes */
+  array = (unsigned int *)((char *)ring->sq_ring + p.sq_off.array);
+  for (i = 0; i < p.sq_entries; ++i)
+    array [i] = i;
+
+  ring->features  = p.features;
+  ring->runq_tail = &ring->runq;
+  coro_wheel_init (&ring->wheel, coro_uring_now ());
+
+  return ring;
+
+fail_sqes:
+  err = errno;
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  errno = err;
+fail_cq:
+  err = errno;
+  munmap (ring->sq_ring, ring->sq_ring_size);
+  errno = err;
+fail_sq:
+  err = errno;
+  close (ring->fd);
+  free (ring);
+  errno = err;
+  return 0;
+}
+
+void
+coro_uring_free (struct coro_uring *ring)
+{
+  munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+  munmap (ring->sq_ring, ring->sq_ring_size);
+  close (ring->fd);
+  free (ring);
+}
+
+/*
+ * Submit all pending sqes and, if wait is set, block until at least one
+ * completion is available or the next timer is due. EAGAIN and EBUSY
+ * mean the kernel is short of resources or has completions queued up
+ * that we need to reap first, so they only leave the sqes pending.
+ */
+static int
+coro_uring_enter (struct coro_uring *ring, unsigned int wait)
+{
+  unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  uint64_t timeout;
+
+  __atomic_store_n (ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  if (wait && (timeout = coro_wheel_timeout (&ring->wheel)) != UINT64_MAX)
+    {
+      ts.tv_sec  = timeout / 1000;
+      ts.tv_nsec = timeout % 1000 * 1000000;
+
+      memset (&arg, 0, sizeof (arg));
+      arg.ts = (uintptr_t)&ts;
+      flags |= IORING_ENTER_EXT_ARG;
+    }
+
+  for (;;)
+    {
+      int res = syscall (__NR_io_uring_enter, ring->fd, ring->pending, wait, flags,
+                         flags & IORING_ENTER_EXT_ARG ? &arg : 0,
+                         flags & IORING_ENTER_EXT_ARG ? sizeof (arg) : 0);
+
+      if (res >= 0)
+        {
+          ring->pending -= res;
+          return 0;
+        }
+
+      if (errno == EAGAIN || errno == EBUSY || errno == ETIME)
+        return 0;
+
+      if (errno != EINTR)
+        return -1;
+    }
+}
+
+static void *
+coro_uring_start (void *value)
+{
+  struct coro_uring_task *task = (struct coro_uring_task *)coro_asym_current ();
+
+  (void)value;
+  task->func (task->arg);
+
+  return 0;
+}
+
+static void
+coro_uring_resume (struct coro_uring *ring, struct coro_uring_task *task, int res)
+{
+  coro_resume (&task->co, (void *)(intptr_t)res);
+
+  if (task->co.status == CORO_ASYM_DONE)
+    {
+      coro_asym_destroy (&task->co);
+      coro_stack_free (&task->stack);
+      free (task);
+      --ring->ntasks;
+    }
+}
+
+static void
+coro_uring_ready (struct coro_uring *ring, struct coro_uring_task *task)
+{
+  task->next = 0;
+  *ring->runq_tail = task;
+  ring->runq_tail = &task->next;
+}
+
+int
+coro_uring_spawn (struct coro_uring *ring, coro_func func, void *arg, unsigned int size)
+{
+  struct coro_uring_task *task = (struct coro_uring_task *)malloc (sizeof (struct coro_uring_task));
+
+  if (!task)
+    return 0;
+
+  if (!coro_stack_alloc (&task->stack, size))
+    {
+      free (task);
+      return 0;
+    }
+
+  task->func = func;
+  task->arg  = arg;
+
+  coro_asym_create (&task->co, coro_uring_start, task->stack.sptr, task->stack.ssze);
+
+  ++ring->ntasks;
+  coro_uring_ready (ring, task);
+
+  return 1;
+}
+
+void
+coro_uring_yield (struct coro_uring *ring)
+{
+  coro_uring_ready (ring, (struct coro_uring_task *)coro_asym_current ());
+  coro_yield (0);
+}
+
+int
+coro_uring_sleep (struct coro_uring *ring, unsigned int msec)
+{
+  struct coro_timer t;
+
+  /* waiting with a timeout needs IORING_ENTER_EXT_ARG */
+  if (!(ring->features & IORING_FEAT_EXT_ARG))
+    return -ENOSYS;
+
+  t.prev = 0;
+  t.data = coro_asym_current ();
+  /* the clock is truncated to milliseconds, so round up */
+  coro_timer_arm (&ring->wheel, &t, coro_uring_now () + msec + (msec > 0));
+
+  coro_yield (0);
+
+  return 0;
+}
+
+/*
+ * Bring the wheel up to date and queue the sleepers that are due, just
+ * before polling, so the poll timeout is measured from now.
+ */
+static void
+coro_uring_timers (struct coro_uring *ring)
+{
+  struct coro_timer *t;
+
+  if (coro_wheel_timeout (&ring->wheel) == UINT64_MAX)
+    return;
+
+  coro_wheel_advance (&ring->wheel, coro_uring_now ());
+
+  while ((t = coro_wheel_expired (&ring->wheel)))
+    coro_uring_ready (ring, (struct coro_uring_task *)t->data);
+}
+
+int
+coro_uring_run (struct coro_uring *ring)
+{
+  while (ring->ntasks)
+    {
+      struct coro_uring_task *task = ring->runq;
+      unsigned int head;
+
+      /* whatever gets queued while running these waits for the next round */
+      ring->runq = 0;
+      ring->runq_tail = &ring->runq;
+
+      while (task)
+        {
+          struct coro_uring_task *next = task->next;
+
+          coro_uring_resume (ring, task, 0);
+          task = next;
+        }
+
+      if (!ring->ntasks)
+        break;
+
+      coro_uring_timers (ring);
+
+      /* one system call submits everything queued since the last one */
+      if (ring->pending || !ring->runq)
+        if (coro_uring_enter (ring, !ring->runq) < 0)
+          return -1;
+
+      head = *ring->cq_head;
+
+      while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+          struct io_uring_cqe *cqe = ring->cqes + (head & ring->cq_mask);
+          struct coro_uring_task *task = (struct coro_uring_task *)(uintptr_t)cqe->user_data;
+          int res = cqe->res;
+
+          /* hand the slot back before the task can queue more requests */
+          __atomic_store_n (ring->cq_head, ++head, __ATOMIC_RELEASE);
+          coro_uring_resume (ring, task, res);
+        }
+    }
+
+  return 0;
+}
+
+/*
+ * Return a cleared sqe. When the submission queue is full, submit it,
+ * and if that does not free any slots, let the reactor reap completions
+ * first.
+ */
+static struct io_uring_sqe *
+coro_uring_sqe (struct coro_uring *ring, int opcode, int fd)
+{
+  struct io_uring_sqe *sqe;
+
+  while (ring->sqe_tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    if (coro_uring_enter (ring, 0) < 0
+        || ring->sqe_tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+      coro_uring_yield (ring);
+
+  sqe = ring->sqes + (ring->sqe_tail++ & ring->sq_mask);
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = opcode;
+  sqe->fd     = fd;
+  ++ring->pending;
+
+  return sqe;
+}
+
+/* switch back to the reactor until the sqe completes */
+static int
+coro_uring_wait (struct io_uring_sqe *sqe)
+{
+  sqe->user_data = (uintptr_t)coro_asym_current ();
+
+  return (int)(intptr_t)coro_yield (0);
+}
+
+int
+coro_uring_read (struct coro_uring *ring, int fd, void *buf, unsigned int len, off_t offset)
+{
+  struct io_uring_sqe *sqe = coro_uring_sqe (ring, IORING_OP_READ, fd);
+
+  sqe->addr = (uintptr_t)buf;
+  sqe->len  = len;
+  sqe->off  = (__u64)offset;
+
+  return coro_uring_wait (sqe);
+}
+
+int
+coro_uring_write (struct coro_uring *ring, int fd, const void *buf, unsigned int len, off_t offset)
+{
+  struct io_uring_sqe *sqe = coro_uring_sqe (ring, IORING_OP_WRITE, fd);
+
+  sqe->addr = (uintptr_t)buf;
+  sqe->len  = len;
+  sqe->off  = (__u64)offset;
+
+  return coro_uring_wait (sqe);
+}
+
+int
+coro_uring_accept (struct coro_uring *ring, int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+  struct io_uring_sqe *sqe = coro_uring_sqe (ring, IORING_OP_ACCEPT, fd);
+
+  sqe->addr  = (uintptr_t)addr;
+  sqe->addr2 = (uintptr_t)addrlen;
+
+  return coro_uring_wait (sqe);
+}
+
+int
+coro_uring_connect (struct coro_uring *ring, int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+  struct io_uring_sqe *sqe = coro_uring_sqe (ring, IORING_OP_CONNECT, fd);
+
+  sqe->addr = (uintptr_t)addr;
+  sqe->off  = addrlen;
+
+  return coro_uring_wait (sqe);
+}
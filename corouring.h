@@ -0,0 +1,98 @@
+/*
+ * This file is part of libcoro and may be used under the same terms as
+ * coro.c and coro.h (see LICENSE).
+ */
+
+/*
+ * An optional io_uring reactor for Linux: coroutines started with
+ * coro_uring_spawn call coro_uring_read and friends, which queue the
+ * request and switch back to the reactor loop. The loop submits
+ * everything that was queued since the last round with a single
+ * io_uring_enter system call, then resumes each coroutine whose request
+ * completed, with the result of the request.
+ *
+ * A reactor belongs to the thread that runs coro_uring_run, and all its
+ * coroutines run on that thread. It is built on the asymmetric
+ * coroutines (coro_resume/coro_yield), so the I/O functions must be
+ * called from the coroutine the reactor started, not from a coroutine
+ * that one resumed in turn.
+ *
+ * Talks to the kernel directly (Linux 5.6 or newer), liburing is not
+ * needed. Build with -During=true to include it in the library.
+ */
+
+#ifndef COROURING_H
+#define COROURING_H
+
+#include "coro.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#if __cplusplus
+extern "C" {
+#endif
+
+struct coro_uring;
+
+/*
+ * Create a reactor whose submission queue has room for (at least)
+ * entries requests, 256 if 0. More requests than that can be in flight,
+ * they are just submitted in more than one go. Returns 0 and sets errno
+ * on failure, e.g. ENOSYS or EPERM when io_uring is not available.
+ */
+struct coro_uring *coro_uring_new (unsigned int entries);
+
+/*
+ * Free the reactor. It must not have any coroutines left, i.e.
+ * coro_uring_run must have returned.
+ */
+void coro_uring_free (struct coro_uring *ring);
+
+/*
+ * Start a new coroutine running func (arg) on a stack of the given size
+ * (as for coro_stack_alloc) the next time the reactor loop gets around
+ * to it. Its memory is released when func returns. Can be called from
+ * the reactor's coroutines or before coro_uring_run. Returns false if
+ * the memory could not be allocated.
+ */
+int coro_uring_spawn (struct coro_uring *ring, coro_func func, void *arg, unsigned int size);
+
+/*
+ * Run the reactor loop until all of its coroutines have returned.
+ * Returns 0, or -1 with errno set if io_uring_enter failed.
+ */
+int coro_uring_run (struct coro_uring *ring);
+
+/*
+ * The I/O functions suspend the calling coroutine until the request
+ * completes and return what the corresponding system call would have
+ * returned, except that errors are returned as -errno. offset is the
+ * file position to read/write at, -1 means the current one (use -1 for
+ * pipes and sockets).
+ */
+int coro_uring_read (struct coro_uring *ring, int fd, void *buf, unsigned int len, off_t offset);
+int coro_uring_write (struct coro_uring *ring, int fd, const void *buf, unsigned int len, off_t offset);
+int coro_uring_accept (struct coro_uring *ring, int fd, struct sockaddr *addr, socklen_t *addrlen);
+int coro_uring_connect (struct coro_uring *ring, int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * Let the other coroutines of the reactor run, the calling one is
+ * resumed after the next round of completions.
+ */
+void coro_uring_yield (struct coro_uring *ring);
+
+/*
+ * Suspend the calling coroutine for at least msec milliseconds. The
+ * sleepers are kept in a timer wheel (see corotimer.h), and the reactor
+ * blocks no longer than until the first of them is due. Returns 0, or
+ * -ENOSYS if the kernel is older than 5.11 and cannot wait with a
+ * timeout.
+ */
+int coro_uring_sleep (struct coro_uring *ring, unsigned int msec);
+
+#if __cplusplus
+}
+#endif
+
+#endif